@@ -2,16 +2,55 @@
 #define __AR1010_H
 
 #include <stdint.h>
+#include "frequency.h"
+#include "FM_stations.h"
+#include "i2c_queue.h"
+
+#define AR1010_MAX_VOLUME 18
+
+typedef struct
+{
+	uint32_t tunes;
+	uint32_t failed_tunes;		// Timed out, or a seek that found nothing
+	uint32_t last_tune_time;	// us from the tune call to hmute released
+	uint32_t max_tune_time;
+	uint32_t i2c_writes;
+	uint32_t i2c_reads;
+	uint32_t skipped_writes;	// Field updates that left the register unchanged
+	uint32_t verify_failures;
+} AR1010_Stats;
+
+typedef struct
+{
+	uint8_t success;
+	uint16_t chan;		// READCHAN
+	Freq_kHz freq;
+	uint8_t rssi;
+	uint8_t stereo;
+} AR1010_Result;
+
+typedef void (*AR1010_Callback)(const AR1010_Result *result);
 
 void AR1010_init();
-void AR1010_scan(uint16_t lower, uint16_t upper);
-void AR1010_tune(float freq, uint8_t convert);
-void AR1010_auto_tune(float freq, uint8_t convert);
+uint32_t AR1010_verify();
+uint8_t AR1010_scan(Freq_kHz lower, Freq_kHz upper, FM_Station_List *list);
+void AR1010_set_seek_threshold(uint8_t threshold);
+uint16_t AR1010_channel(Freq_kHz freq);
+Freq_kHz AR1010_channel_freq(uint16_t chan);
+void AR1010_tune(Freq_kHz freq);
+void AR1010_tune_channel(uint16_t chan);
+void AR1010_auto_tune(Freq_kHz freq);
+void AR1010_auto_tune_channel(uint16_t chan);
 void AR1010_seek();
 void AR1010_auto_seek();
+uint8_t AR1010_tune_async(Freq_kHz freq, AR1010_Callback callback);
+uint8_t AR1010_auto_tune_async(Freq_kHz freq, AR1010_Callback callback);
+uint8_t AR1010_seek_async(AR1010_Callback callback);
+uint8_t AR1010_auto_seek_async(AR1010_Callback callback);
+uint8_t AR1010_busy();
+void AR1010_task();
+void AR1010_set_mute(uint8_t mute);
 void AR1010_set_volume(uint8_t volume);
-
-extern void I2C_write(uint8_t address, uint8_t *data, uint16_t size);
-extern void I2C_read(uint8_t address, uint8_t *read_buffer, uint16_t size);
+void AR1010_get_stats(AR1010_Stats *stats);
 
 #endif
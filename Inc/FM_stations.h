@@ -0,0 +1,33 @@
+#ifndef __FM_STATIONS_H
+#define __FM_STATIONS_H
+
+#include <stdint.h>
+#include "frequency.h"
+
+#define FM_MAX_STATIONS		64
+#define FM_NO_PI			0x0000
+
+typedef struct
+{
+	Freq_kHz freq;
+	uint16_t pi;		// FM_NO_PI when no RDS was decoded during the scan
+	int8_t rssi;		// dBuV
+	int8_t snr;			// dB
+	uint8_t multipath;	// %
+} FM_Station;
+
+typedef struct
+{
+	uint8_t size;
+	uint32_t scan_time; // ms taken by the scan that produced the list
+	FM_Station stations[FM_MAX_STATIONS];
+} FM_Station_List;
+
+void FM_stations_clear(FM_Station_List *list);
+uint8_t FM_stations_add(FM_Station_List *list, const FM_Station *station);
+int16_t FM_stations_score(const FM_Station *station);
+void FM_stations_rank(FM_Station_List *list);
+void FM_stations_save(const FM_Station_List *list);
+uint8_t FM_stations_load(FM_Station_List *list);
+
+#endif
@@ -3,10 +3,66 @@
 
 #include "stdint.h"
 
+#define SST25_READ_CHUNK	512 // Bytes per DMA transfer in a bulk read, two are in flight
+#define SST25_CACHE_PAGE_SIZE	256 // Reads up to this size are served through the page cache, longer ones go straight to the flash
+#define SST25_CACHE_PAGES		8
+
+// error is non-zero if the SPI transfer failed. Runs in the DMA interrupt
+typedef void (*SST25_Callback)(uint8_t error, void *context);
+
+// Sequential reader, the next chunk is fetched by DMA while the caller parses the current one
+typedef struct
+{
+	uint32_t address;		// Next address to request
+	uint32_t remaining;		// Bytes not yet requested
+	uint8_t *buffers[2];
+	uint16_t sizes[2];
+	volatile uint8_t ready[2];
+	uint8_t current;
+} SST25_Reader;
+
+typedef struct
+{
+	uint32_t reads;
+	uint32_t bytes_read;
+	uint32_t read_time;		// us with a read on the bus
+	uint32_t writes;
+	uint32_t bytes_written;
+	uint32_t write_time;	// us from the first command to the end of the last program
+	uint32_t errors;
+	uint32_t ready_interrupts;	// AAI words completed through the SO EXTI
+	uint32_t unpooled;		// DMA transfers into buffers outside the DMA pool
+	uint32_t cache_hits;	// Page lookups
+	uint32_t cache_misses;
+	uint32_t cache_bypasses;	// Reads too long for the cache
+	uint32_t read_aheads;
+	uint32_t read_ahead_hits;	// Read-ahead pages used before they were evicted
+} SST25_Stats;
+
+void SST25_init();
 void SST25_read(uint32_t address, uint8_t *read_buffer, uint16_t size);
 void SST25_write_byte(uint32_t address, uint8_t data);
 void SST25_write(uint32_t address, uint8_t *data, uint16_t size);
+void SST25_write_polled(uint32_t address, uint8_t *data, uint16_t size);
 void SST25_sector_erase_4K(uint32_t address);
+void SST25_sector_erase_4K_start(uint32_t address);
+uint8_t SST25_erase_busy();
+
+// Return 1 if a transfer is already running. Buffers must stay valid until the callback
+uint8_t SST25_read_async(uint32_t address, uint8_t *read_buffer, uint16_t size, SST25_Callback callback, void *context);
+uint8_t SST25_write_async(uint32_t address, const uint8_t *data, uint16_t size, SST25_Callback callback, void *context);
+uint8_t SST25_busy();
+void SST25_ready_interrupt();
+
+uint8_t SST25_reader_open(SST25_Reader *reader, uint32_t address, uint32_t size);
+const uint8_t *SST25_reader_next(SST25_Reader *reader, uint16_t *size);
+void SST25_reader_close(SST25_Reader *reader);
+
+void SST25_get_stats(SST25_Stats *stats);
+uint32_t SST25_read_rate();
+uint32_t SST25_write_rate();
+uint8_t SST25_cache_hit_rate();
+void SST25_reset_stats();
 
 extern void flash_SPI_write(uint8_t *data, uint16_t size);
 extern void flash_SPI_read(uint8_t *read_buffer, uint16_t size);
@@ -2,8 +2,10 @@
 #define __SI468X_H
 
 #include <stdint.h>
+#include "i2c_queue.h"
 
 #define Si4684_ADDRESS 0x64
+#define SI468X_MAX_VOLUME 63
 
 typedef struct
 {
@@ -17,7 +19,7 @@ enum Si468x_MODE
 	Si468x_MODE_DAB =	0x00092000
 };
 
-union
+typedef union
 {
 	struct
 	{
@@ -29,9 +31,12 @@ union
 		uint8_t DACQINT	: 1;
 		uint8_t ERR_CMD : 1;
 		uint8_t CTS		: 1;
+		uint8_t			: 5;
+		uint8_t DEVNTINT : 1;
+		uint8_t			: 2;
 	};
-	uint8_t interrupt_register;
-} Interrupt_Status;
+	uint16_t interrupt_register;
+} Si468x_Interrupts;
 
 enum Interrupt
 {
@@ -42,26 +47,56 @@ enum Interrupt
 	DSRVINT,
 	DACQINT,
 	ERR_CMD,
-	CTS
+	CTS,
+	DEVNTINT = 13
 };
 
-enum Si468x_MODE current_mode;
+typedef void (*Si468x_Write)(uint8_t address, uint8_t *data, uint16_t size);
+typedef void (*Si468x_Write_Read)(uint8_t address, uint8_t *data, uint16_t size, uint8_t *read_buffer, uint16_t read_size);
 
-void si468x_init(enum Si468x_MODE mode);
-void si468x_reset();
-void si468x_interrupt();
+// One per chip. The bus and reset hooks let a second chip, or an emulated one, sit behind the same driver
+typedef struct
+{
+	uint8_t address;
+	Si468x_Write write;
+	Si468x_Write_Read write_read; // Repeated start between the two
+	void (*reset)(uint8_t assert);
+
+	enum Si468x_MODE mode;
+	Si468x_Interrupts interrupts;
+	uint8_t patched;
+	volatile uint8_t update_interrupts; // Set from the INT pin EXTI
+	uint8_t async_pending;
+} Si468x_Device;
+
+extern Si468x_Device si468x_main; // The Si4684 on I2C1
+extern Si468x_Device *si468x_device; // The chip the DAB and FM layers drive, read once per operation
+
+void si468x_select(Si468x_Device *device);
+
+// Core calls name their chip, so commands to two chips can interleave
+
+void si468x_init(Si468x_Device *device, enum Si468x_MODE mode);
+void si468x_reset(Si468x_Device *device);
+void si468x_interrupt(Si468x_Device *device);
+void si468x_service_interrupts(Si468x_Device *device);
+void si468x_set_property(Si468x_Device *device, uint16_t property, uint16_t value);
+void si468x_set_volume(Si468x_Device *device, uint8_t volume);
+void si468x_set_mute(Si468x_Device *device, uint8_t mute);
 
 Si468x_Command *si468x_build_command(uint8_t command_id, uint8_t *args, uint16_t num_args);
 Si468x_Command *si468x_build_command_ext(uint8_t command_id, uint8_t *args, uint16_t num_args, uint8_t *data, uint16_t data_size);
-uint8_t si468x_execute(Si468x_Command *command);
-uint8_t si468x_execute_ext(Si468x_Command *command, uint8_t use_interrupt);
+uint8_t si468x_execute(Si468x_Device *device, Si468x_Command *command);
+uint8_t si468x_execute_ext(Si468x_Device *device, Si468x_Command *command, uint8_t use_interrupt);
+void si468x_execute_async(Si468x_Device *device, Si468x_Command *command);
+uint8_t si468x_async_pending(Si468x_Device *device);
+uint8_t si468x_interrupt_pending(Si468x_Device *device);
+uint8_t si468x_async_ready(Si468x_Device *device);
+uint8_t si468x_read_async_response(Si468x_Device *device, uint8_t *response_buffer, uint16_t response_size);
 void si468x_free_command(Si468x_Command *command);
 
-void si468x_wait_for_interrupt(enum Interrupt interrupt);
-uint8_t si468x_read_response(uint8_t *response_buffer, uint16_t response_size);
-void si468x_update_interrupts();
-
-extern void I2C_write(uint8_t address, uint8_t *data, uint16_t size);
-extern void I2C_read(uint8_t address, uint8_t *read_buffer, uint16_t size);
+void si468x_wait_for_interrupt(Si468x_Device *device, enum Interrupt interrupt);
+uint8_t si468x_read_response(Si468x_Device *device, uint8_t *response_buffer, uint16_t response_size);
+void si468x_update_interrupts(Si468x_Device *device);
 
 #endif
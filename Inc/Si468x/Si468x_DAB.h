@@ -2,6 +2,10 @@
 #define __SI468X_DAB_H
 
 #include <stdint.h>
+#include "frequency.h"
+#include "Si468x/Si468x.h"
+
+#define DAB_MAX_FREQUENCIES 48
 
 typedef struct
 {
@@ -22,6 +26,15 @@ typedef struct
 			uint8_t FICERR		: 1;
 			uint8_t HARDMUTE	: 1;
 			uint8_t				: 3;
+			int8_t rssi;				// dBuV
+			int8_t snr;					// dB
+			uint8_t fic_quality;		// %
+			uint8_t cnr;				// dB
+			uint16_t fib_error_count;
+			Freq_kHz tune_freq;
+			uint8_t tune_index;
+			int8_t tune_offset;
+			int8_t fft_offset;
 		};
 	};
 } DAB_DigRad_Status;
@@ -64,21 +77,120 @@ typedef struct
 	};
 } DAB_Time;
 
+enum DAB_Region
+{
+	DAB_REGION_EUROPE		= 0, // Band III 5A-13F
+	DAB_REGION_KOREA		= 1, // T-DMB 7A-13C
+	DAB_REGION_AUSTRALIA	= 2  // Band III 9A-9C
+};
+
+typedef struct
+{
+	uint8_t region;
+	uint8_t learned; // Only channels that carried an ensemble in the last full scan
+	uint8_t size;
+	Freq_kHz frequencies[DAB_MAX_FREQUENCIES];
+} DAB_Freq_Plan;
+
+enum DAB_User_Application
+{
+	UA_SLIDESHOW	= 0x0001,
+	UA_BWS			= 0x0002,
+	UA_TPEG			= 0x0004,
+	UA_EPG			= 0x0008,
+	UA_JOURNALINE	= 0x0010,
+	UA_OTHER		= 0x8000,
+	UA_UNKNOWN		= 0xFFFF // Component info not fetched yet
+};
+
 enum Digital_Service_Type
 {
 	SER_AUDIO = 0,
 	SER_DATA = 1
 };
 
-void si468x_DAB_set_freq_list();
+enum DAB_Announcement_Type // ASu flags, ETSI EN 300 401 table 14
+{
+	ANNO_ALARM				= 0x0001,
+	ANNO_ROAD_TRAFFIC		= 0x0002,
+	ANNO_TRANSPORT_FLASH	= 0x0004,
+	ANNO_WARNING			= 0x0008,
+	ANNO_NEWS				= 0x0010,
+	ANNO_WEATHER			= 0x0020,
+	ANNO_EVENT				= 0x0040,
+	ANNO_SPECIAL_EVENT		= 0x0080,
+	ANNO_PROGRAMME_INFO		= 0x0100,
+	ANNO_SPORT				= 0x0200,
+	ANNO_FINANCIAL			= 0x0400
+};
+
+enum DAB_Audio_Mode
+{
+	AUDIO_DUAL_MONO		= 0,
+	AUDIO_MONO			= 1,
+	AUDIO_STEREO		= 2,
+	AUDIO_JOINT_STEREO	= 3
+};
+
+enum DAB_Service_Stats_Valid
+{
+	STATS_AUDIO_INFO	= 0x01,
+	STATS_SUBCHAN_INFO	= 0x02
+};
+
+typedef struct
+{
+	uint8_t valid;				// DAB_Service_Stats_Valid flags
+	uint8_t service_mode;		// 0 audio, 1 data stream, 3 packet data, 4 DAB+, 5 DAB
+	uint8_t protection_info;	// 1-5 UEP-1..5, 6-9 EEP-1A..4A, 10-13 EEP-1B..4B
+	uint8_t audio_mode;			// DAB_Audio_Mode
+	uint8_t sbr;				// HE-AAC spectral band replication
+	uint8_t ps;					// HE-AACv2 parametric stereo
+	uint8_t drc_gain;			// 0.25 dB steps
+	uint16_t audio_bit_rate;	// kbps
+	uint16_t sample_rate;		// Hz
+	uint16_t subchan_bit_rate;	// kbps, including error protection
+	uint16_t num_cu;			// Capacity units
+	uint16_t cu_address;
+} DAB_Service_Stats;
+
+typedef struct
+{
+	uint8_t queue_size;
+	uint8_t cluster_id;
+	uint8_t source;		// 0 for the tuned ensemble
+	uint8_t started;	// 1 on announcement start, 0 on end
+	uint16_t asw;		// Active announcement types
+	uint16_t id1;
+	uint16_t id2;		// Subchannel carrying the announcement
+} DAB_Announcement;
+
+void si468x_DAB_set_freq_list(Si468x_Device *device);
+void si468x_DAB_set_region(enum DAB_Region region);
+const DAB_Freq_Plan *si468x_DAB_get_freq_plan();
+uint32_t si468x_DAB_freq_plan_hash();
 void si468x_DAB_tune(uint8_t freq_index);
+uint8_t si468x_DAB_calibrate_antcap();
 void si468x_DAB_band_scan();
+uint8_t si468x_DAB_quick_scan();
 void si468x_DAB_get_digrad_status(DAB_DigRad_Status *status);
 void si468x_DAB_get_event_status(DAB_Event_Status *status);
-void si468x_DAB_get_component_info(uint32_t service_id, uint32_t component_id);
+uint8_t si468x_DAB_request_component_info(uint16_t service_mem_id, uint8_t component_index);
+uint8_t si468x_DAB_poll_component_info();
+uint16_t si468x_DAB_get_user_applications(uint16_t service_mem_id, uint8_t component_index);
 void si468x_DAB_start_digital_service(uint32_t service_id, uint32_t component_id, enum Digital_Service_Type service_type);
 void si468x_DAB_tune_service(uint16_t service_mem_id);
+uint8_t si468x_DAB_load_scan_cache(uint16_t *last_service_mem_id);
+uint16_t si468x_DAB_get_num_services();
+uint16_t si468x_DAB_get_current_service();
+uint32_t si468x_DAB_get_service_id(uint16_t service_mem_id);
 void si468x_DAB_get_digital_service_data(uint8_t *buffer, uint16_t *size, uint8_t only_status);
-DAB_Time si468x_DAB_get_time();
+DAB_Time si468x_DAB_get_time(uint8_t utc);
+void si468x_DAB_enable_announcements(uint16_t announcement_types);
+uint8_t si468x_DAB_get_announcement_info(DAB_Announcement *announcement);
+void si468x_DAB_process_events();
+uint8_t si468x_DAB_update_service_stats();
+uint8_t si468x_DAB_get_service_stats(uint16_t service_mem_id, DAB_Service_Stats *stats);
+uint32_t si468x_DAB_get_pcm_bit_rate(uint16_t service_mem_id);
 
 #endif
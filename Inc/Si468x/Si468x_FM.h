@@ -1,8 +1,42 @@
 #ifndef __SI468X_FM_H
 #define __SI468X_FM_H
 
-void si468x_FM_tune(float MHz);
-float si468x_FM_seek(uint8_t up, uint8_t wrap);
-void si468x_FM_RDS_status();
+#include <stdint.h>
+#include "FM_stations.h"
+#include "frequency.h"
+#include "Si468x/Si468x.h"
+
+typedef struct
+{
+	uint8_t valid;
+	uint8_t band_limit; // Seek stopped at the band edge
+	Freq_kHz freq;
+	int8_t freq_offset;	// ppm
+	int8_t rssi;		// dBuV
+	int8_t snr;			// dB
+	uint8_t multipath;	// %
+} FM_RSQ_Status;
+
+typedef struct
+{
+	uint32_t checks;
+	uint32_t switches;
+	uint32_t failed_switches;	// PI mismatch, tuned back
+	uint16_t last_check_time;	// ms muted by the last AF check
+	uint16_t max_check_time;
+} FM_AF_Stats;
+
+void si468x_FM_set_band(enum Freq_Band band);
+void si468x_FM_tune(Freq_kHz freq);
+Freq_kHz si468x_FM_seek(uint8_t up, uint8_t wrap);
+void si468x_FM_seek_start(uint8_t up, uint8_t wrap);
+void si468x_FM_get_rsq_status(FM_RSQ_Status *status);
+uint8_t si468x_FM_band_scan(FM_Station_List *list);
+uint16_t si468x_FM_wait_for_pi(uint16_t timeout);
+void si468x_FM_RDS_enable(Si468x_Device *device);
+uint8_t si468x_FM_RDS_service();
+void si468x_FM_AF_enable(uint8_t enable);
+void si468x_FM_AF_task();
+void si468x_FM_AF_get_stats(FM_AF_Stats *stats);
 
 #endif
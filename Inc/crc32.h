@@ -0,0 +1,11 @@
+#ifndef __CRC32_H
+#define __CRC32_H
+
+#include <stdint.h>
+
+#define CRC32_INIT 0xFFFFFFFF
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, uint32_t size);
+uint32_t crc32(const uint8_t *data, uint32_t size);
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef __CYCLE_COUNTER_H
+#define __CYCLE_COUNTER_H
+
+#include <stdint.h>
+
+// DWT cycle counter, started in main() before the drivers. Wraps every ~20 s at 216 MHz, only differences are meaningful
+#define DWT_CYCCNT ((volatile uint32_t *)0xE0001004)
+#define CPU_CYCLES *DWT_CYCCNT
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef __DMA_POOL_H
+#define __DMA_POOL_H
+
+#include <stdint.h>
+
+#define DMA_POOL_SLOT_SIZE	32 // One Cortex-M7 cache line
+#define DMA_POOL_SLOTS		512
+#define DMA_POOL_SIZE		(DMA_POOL_SLOT_SIZE * DMA_POOL_SLOTS) // Power of two, the MPU region covers it exactly
+
+typedef struct
+{
+	uint32_t allocs;
+	uint32_t failures;		// No free run long enough
+	uint16_t used_slots;
+	uint16_t peak_slots;
+} DMA_Pool_Stats;
+
+void dma_pool_init();
+void *dma_pool_alloc(uint16_t size);
+void dma_pool_free(void *buffer);
+uint8_t dma_pool_contains(const void *buffer, uint16_t size);
+void dma_pool_get_stats(DMA_Pool_Stats *stats);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef __DUAL_TUNER_H
+#define __DUAL_TUNER_H
+
+#include <stdint.h>
+#include "frequency.h"
+#include "FM_stations.h"
+
+typedef struct
+{
+	uint32_t sweeps;
+	uint32_t sweep_time;		// ms taken by the last full sweep
+	uint32_t deferred_steps;	// Background tunes postponed for foreground bus traffic
+} Dual_Tuner_Stats;
+
+// The AR1010 sweeps the FM band muted while the Si468x plays
+void dual_tuner_enable(uint8_t enable);
+void dual_tuner_task();
+void dual_tuner_hold(uint16_t ms);
+
+uint8_t dual_tuner_valid();
+uint8_t dual_tuner_get_rssi(Freq_kHz freq);
+uint8_t dual_tuner_get_stations(FM_Station_List *list);
+Freq_kHz dual_tuner_strongest(const Freq_kHz *freqs, uint8_t count);
+void dual_tuner_get_stats(Dual_Tuner_Stats *stats);
+
+#endif
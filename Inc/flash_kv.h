@@ -0,0 +1,45 @@
+#ifndef __FLASH_KV_H
+#define __FLASH_KV_H
+
+#include <stdint.h>
+
+#define FLASH_KV_MAX_KEYS		192 // Settings plus a user application key per DAB service
+#define FLASH_KV_MIN_FREE		2	// Erased sectors kept ready, the last one is only for compaction
+#define FLASH_KV_WEAR_SPREAD	16	// Erase count gap that moves cold data off the least worn sector
+#define FLASH_KV_MAX_PENDING	4	// Writes held in RAM while no sector is erased
+
+enum Flash_KV_Status
+{
+	FLASH_KV_OK			= 0,
+	FLASH_KV_NOT_FOUND	= 1,
+	FLASH_KV_FULL		= 2, // Out of keys, or no erased sector and no room to hold the write
+	FLASH_KV_TOO_LARGE	= 3,
+	FLASH_KV_PENDING	= 4  // No erased sector ready, held in RAM until flash_kv_task writes it
+};
+
+typedef struct
+{
+	uint32_t writes;
+	uint32_t bytes_written;
+	uint32_t erases;
+	uint32_t compactions;
+	uint32_t relocated_bytes;	// Live data copied out of compacted sectors
+	uint32_t deferred_writes;	// Held in RAM for lack of an erased sector
+	uint32_t failed_writes;
+	uint32_t corrupt_records;	// Failed their CRC at boot
+	uint32_t min_erase_count;
+	uint32_t max_erase_count;
+	uint16_t free_sectors;
+	uint16_t keys;
+} Flash_KV_Stats;
+
+// Keys are 0x0000-0xFFFE, 0xFFFF marks erased flash
+void flash_kv_init();
+void flash_kv_task();
+uint16_t flash_kv_size(uint16_t key);
+uint8_t flash_kv_read(uint16_t key, void *data, uint16_t size);
+uint8_t flash_kv_write(uint16_t key, const void *data, uint16_t size);
+uint8_t flash_kv_delete(uint16_t key);
+void flash_kv_get_stats(Flash_KV_Stats *stats);
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef __FLASH_MAP_H
+#define __FLASH_MAP_H
+
+// SST25 layout, every region starts on a 4K sector boundary
+#define FLASH_SECTOR_SIZE			4096
+
+#define FLASH_SCAN_CACHE_ADDRESS	0x000000 // Header followed by the last service journal
+#define FLASH_SERVICES_ADDRESS		0x002000 // One sector per service
+#define FLASH_MAX_SERVICES			128
+#define FLASH_KV_ADDRESS			0x082000 // Log-structured key/value store, see flash_kv
+#define FLASH_KV_SECTORS			64
+
+// Key/value store keys
+#define FLASH_KEY_FREQ_PLAN			0x0001
+#define FLASH_KEY_ANTCAP			0x0002
+#define FLASH_KEY_FM_STATIONS		0x0003
+#define FLASH_KEY_USER_APPLICATIONS	0x0100 // + service_mem_id, DAB_User_Application flags per component
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef __FREQUENCY_H
+#define __FREQUENCY_H
+
+#include <stdint.h>
+
+// Every tuner API takes kHz, so conversions to chip units are exact integer divisions
+typedef uint32_t Freq_kHz;
+
+#define FREQ_MHZ(mhz, khz)	((Freq_kHz) (mhz) * 1000 + (khz)) // FREQ_MHZ(88, 100) is 88.1 MHz
+
+#define FM_EUROPE_BOTTOM	FREQ_MHZ(87, 500)
+#define FM_EUROPE_TOP		FREQ_MHZ(108, 0)
+#define FM_EUROPE_SPACING	100
+#define FM_US_BOTTOM		FREQ_MHZ(87, 900)
+#define FM_US_TOP			FREQ_MHZ(107, 900)
+#define FM_US_SPACING		200
+#define FM_JAPAN_BOTTOM		FREQ_MHZ(76, 0)
+#define FM_JAPAN_TOP		FREQ_MHZ(95, 0)
+#define FM_JAPAN_SPACING	100
+
+#define FREQ_RASTER_CHANNELS(bottom, top, spacing)	(((top) - (bottom)) / (spacing) + 1)
+
+enum Freq_Band
+{
+	BAND_FM_EUROPE	= 0,
+	BAND_FM_US		= 1,
+	BAND_FM_JAPAN	= 2,
+	NUM_FREQ_BANDS
+};
+
+typedef struct
+{
+	Freq_kHz bottom;
+	Freq_kHz top;
+	uint16_t spacing; // kHz
+	uint16_t channels;
+} Freq_Raster;
+
+extern const Freq_Raster freq_rasters[NUM_FREQ_BANDS];
+
+uint8_t freq_in_band(enum Freq_Band band, Freq_kHz freq);
+uint16_t freq_to_channel(enum Freq_Band band, Freq_kHz freq);
+Freq_kHz freq_from_channel(enum Freq_Band band, uint16_t channel);
+Freq_kHz freq_snap(enum Freq_Band band, Freq_kHz freq);
+
+#endif
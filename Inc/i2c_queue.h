@@ -0,0 +1,53 @@
+#ifndef __I2C_QUEUE_H
+#define __I2C_QUEUE_H
+
+#include <stdint.h>
+
+#define I2C_QUEUE_SIZE 8
+
+enum I2C_Job_Status
+{
+	I2C_JOB_PENDING	= 0,
+	I2C_JOB_DONE	= 1,
+	I2C_JOB_ERROR	= 2
+};
+
+typedef struct I2C_Job I2C_Job;
+typedef void (*I2C_Callback)(const I2C_Job *job);
+
+// Write, read, or write then read with a repeated start. Buffers must stay valid until the callback,
+// buffers from dma_pool_alloc are used in place and others are copied through the pool
+struct I2C_Job
+{
+	uint8_t address;
+	uint8_t *tx;
+	uint16_t tx_size;
+	uint8_t *rx;
+	uint16_t rx_size;
+	I2C_Callback callback; // Runs in the DMA interrupt
+	void *context;
+	uint8_t status;
+};
+
+typedef struct
+{
+	uint32_t jobs;
+	uint32_t errors;
+	uint32_t bytes;
+	uint32_t busy_cycles;	// CPU cycles with a transfer on the bus
+	uint32_t rejected;		// Submitted to a full ring
+	uint32_t staged_bytes;	// Copied through the DMA pool for callers with their own buffers
+	uint32_t unstaged;		// Pool full, fell back to cache maintenance
+	uint8_t max_depth;
+} I2C_Queue_Stats;
+
+uint8_t i2c_queue_submit(const I2C_Job *job);
+uint8_t i2c_queue_busy();
+void i2c_queue_get_stats(I2C_Queue_Stats *stats);
+
+// Blocking helpers, queued behind any async jobs
+void I2C_write(uint8_t address, uint8_t *data, uint16_t size);
+void I2C_read(uint8_t address, uint8_t *read_buffer, uint16_t size);
+void I2C_write_read(uint8_t address, uint8_t *data, uint16_t size, uint8_t *read_buffer, uint16_t read_size);
+
+#endif
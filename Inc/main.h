@@ -122,6 +122,8 @@
 #define TCK_GPIO_Port GPIOA
 #define FLASH_SS_Pin GPIO_PIN_15
 #define FLASH_SS_GPIO_Port GPIOA
+#define FLASH_MISO_Pin GPIO_PIN_11
+#define FLASH_MISO_GPIO_Port GPIOC
 #define TAS_PDN_Pin GPIO_PIN_0
 #define TAS_PDN_GPIO_Port GPIOD
 #define TAS_RST_Pin GPIO_PIN_1
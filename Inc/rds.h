@@ -0,0 +1,70 @@
+#ifndef __RDS_H
+#define __RDS_H
+
+#include <stdint.h>
+#include "frequency.h"
+
+#define RDS_PS_LENGTH		8
+#define RDS_RT_LENGTH		64
+#define RDS_MAX_AF			25
+
+#define RDS_BLOCK_A			0
+#define RDS_BLOCK_B			1
+#define RDS_BLOCK_C			2
+#define RDS_BLOCK_D			3
+
+enum RDS_Block_Errors // BLE as reported by the tuner
+{
+	RDS_BLE_NONE			= 0,
+	RDS_BLE_CORRECTED_1_2	= 1,
+	RDS_BLE_CORRECTED_3_5	= 2,
+	RDS_BLE_UNCORRECTABLE	= 3
+};
+
+enum RDS_Valid
+{
+	RDS_VALID_PI		= 0x01,
+	RDS_VALID_PTY		= 0x02,
+	RDS_VALID_PS		= 0x04,
+	RDS_VALID_RT		= 0x08,
+	RDS_VALID_RT_PLUS	= 0x10,
+	RDS_VALID_AF		= 0x20,
+	RDS_VALID_CT		= 0x40
+};
+
+typedef struct
+{
+	uint8_t content_type; // RT+ class, 1 title, 4 artist...
+	uint8_t start;
+	uint8_t length;
+} RDS_RT_Plus_Tag;
+
+typedef struct
+{
+	uint8_t valid; // RDS_Valid flags
+	uint16_t pi;
+	uint8_t pty;
+	uint8_t tp;
+	uint8_t ta;
+	char ps[RDS_PS_LENGTH + 1];
+	char rt[RDS_RT_LENGTH + 1];
+	RDS_RT_Plus_Tag rt_plus[2];
+	uint8_t rt_plus_running;
+	uint8_t num_af;
+	Freq_kHz af[RDS_MAX_AF];
+	uint32_t ct; // UTC seconds since 1970 of the last clock time group
+	int16_t ct_local_offset; // Minutes
+	uint32_t groups;
+	uint32_t dropped_groups; // Block B uncorrectable, or FIFO overflow
+} RDS_Data;
+
+void rds_reset();
+void rds_decode_group(const uint16_t *blocks, const uint8_t *block_errors);
+void rds_group_lost(uint16_t count);
+void rds_publish();
+
+// Readers never block the decoder, safe from any context
+uint32_t rds_get_sequence();
+uint8_t rds_get_snapshot(RDS_Data *data);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef __SERVICE_LINK_H
+#define __SERVICE_LINK_H
+
+#include <stdint.h>
+#include "frequency.h"
+
+#define SERVICE_LINK_MAX			64
+#define SERVICE_LINK_MAX_FREQS		4
+
+typedef struct
+{
+	uint32_t service_id;	// DAB SId
+	uint16_t pi;			// RDS PI of the same programme on FM
+	uint8_t num_freqs;
+	Freq_kHz freqs[SERVICE_LINK_MAX_FREQS];
+} Service_Link;
+
+enum Fallback_State
+{
+	FALLBACK_DAB,			// DAB playing, quality monitored
+	FALLBACK_FADE_TO_FM,
+	FALLBACK_AR1010_FM,		// AR1010 playing the linked station, the Si468x keeps monitoring DAB
+	FALLBACK_FADE_TO_DAB,
+	FALLBACK_SI468X_FM		// No AR1010, the Si468x itself is in FM mode
+};
+
+typedef struct
+{
+	uint32_t fallbacks;
+	uint32_t recoveries;
+	uint32_t unlinked;			// Outages with no FM station to go to
+	uint16_t last_switch_time;	// ms from the first bad DAB sample until FM is at full volume
+	uint16_t max_switch_time;
+	uint16_t last_return_time;	// ms from deciding DAB is back until it is at full volume, only once it has stayed good
+	uint16_t max_return_time;
+} Fallback_Stats;
+
+void service_link_build();
+uint8_t service_link_add(uint32_t service_id, uint16_t pi, Freq_kHz freq);
+const Service_Link *service_link_find(uint32_t service_id);
+void service_link_learn_rds();
+
+void service_link_enable_fallback(uint8_t enable, uint8_t ar1010);
+void service_link_task();
+uint8_t service_link_get_state();
+void service_link_get_stats(Fallback_Stats *stats);
+
+#endif
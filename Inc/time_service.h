@@ -0,0 +1,41 @@
+#ifndef __TIME_SERVICE_H
+#define __TIME_SERVICE_H
+
+#include <stdint.h>
+
+enum Time_Source
+{
+	TIME_SOURCE_NONE	= 0, // Only the RTC, kept across resets by VBAT
+	TIME_SOURCE_DAB		= 1,
+	TIME_SOURCE_RDS		= 2
+};
+
+typedef struct
+{
+	uint16_t year;
+	uint8_t month;
+	uint8_t day;
+	uint8_t hour;
+	uint8_t minute;
+	uint8_t second;
+	uint16_t millisecond;
+} Time_Date;
+
+void time_service_init();
+void time_service_task();
+uint8_t time_service_sync_due();
+void time_service_reference(uint64_t utc_ms, uint8_t source);
+void time_service_set_local_offset(int16_t minutes);
+
+// These only read the RTC, with interrupts masked around the time and date pair, so logging and interrupt
+// handlers can call them. A read while time_service_reference sets the calendar may still see the old date
+uint8_t time_service_is_valid();
+uint8_t time_service_get_source();
+uint32_t time_service_now();
+uint64_t time_service_now_ms();
+void time_service_get_date(Time_Date *date, uint8_t local);
+float time_service_get_drift_ppm();
+
+uint32_t time_service_days_from_date(uint16_t year, uint8_t month, uint8_t day);
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef __TUNER_H
+#define __TUNER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "frequency.h"
+#include "FM_stations.h"
+
+// Common front end over the Si468x DAB/FM, AR1010 and simulated tuners. Nothing here touches the HAL, so code written against it also builds on a host
+
+enum Tuner_Status
+{
+	TUNER_OK			= 0,
+	TUNER_BUSY			= 1, // An operation is still running
+	TUNER_UNSUPPORTED	= 2,
+	TUNER_OUT_OF_BAND	= 3,
+	TUNER_FAILED		= 4  // Nothing found, or the chip timed out
+};
+
+enum Tuner_Capability
+{
+	TUNER_CAP_SEEK		= 0x01,
+	TUNER_CAP_SCAN		= 0x02,
+	TUNER_CAP_METADATA	= 0x04,
+	TUNER_CAP_ASYNC		= 0x08  // Completes from tuner_task, otherwise before tuner_tune/tuner_seek return
+};
+
+typedef struct
+{
+	uint8_t valid;		// Locked, audio available
+	int8_t rssi;		// dBuV
+	int8_t snr;			// dB, 0 when the tuner cannot measure it
+	uint8_t quality;	// 0-100, comparable between tuners of the same kind
+	uint8_t stereo;
+} Tuner_Quality;
+
+typedef struct
+{
+	uint32_t id;		// RDS PI or DAB SId, 0 if unknown
+	char name[17];		// PS or service label
+	char text[65];		// RadioText or DLS
+} Tuner_Metadata;
+
+typedef struct
+{
+	uint8_t status;		// Tuner_Status
+	Freq_kHz freq;
+	Tuner_Quality quality;
+} Tuner_Result;
+
+typedef struct Tuner Tuner;
+typedef void (*Tuner_Callback)(Tuner *tuner, const Tuner_Result *result);
+
+typedef struct
+{
+	uint8_t (*tune)(Tuner *tuner, Freq_kHz freq);
+	uint8_t (*seek)(Tuner *tuner, uint8_t up);
+	uint8_t (*scan)(Tuner *tuner, FM_Station_List *list);
+	uint8_t (*get_quality)(Tuner *tuner, Tuner_Quality *quality);
+	uint8_t (*get_metadata)(Tuner *tuner, Tuner_Metadata *metadata);
+	void (*task)(Tuner *tuner);
+} Tuner_Ops;
+
+struct Tuner
+{
+	const char *name;
+	uint8_t capabilities;	// Tuner_Capability flags
+	Freq_kHz bottom;
+	Freq_kHz top;
+	const Tuner_Ops *ops;
+	uint8_t busy;
+	Tuner_Callback callback;
+	Tuner_Result result;	// Last completed operation
+};
+
+extern Tuner tuner_si468x_dab;
+extern Tuner tuner_si468x_fm;
+extern Tuner tuner_ar1010;
+extern Tuner tuner_sim;
+
+uint8_t tuner_tune(Tuner *tuner, Freq_kHz freq, Tuner_Callback callback);
+uint8_t tuner_seek(Tuner *tuner, uint8_t up, Tuner_Callback callback);
+uint8_t tuner_scan(Tuner *tuner, FM_Station_List *list);
+uint8_t tuner_get_quality(Tuner *tuner, Tuner_Quality *quality);
+uint8_t tuner_get_metadata(Tuner *tuner, Tuner_Metadata *metadata);
+void tuner_task(Tuner *tuner);
+uint8_t tuner_busy(Tuner *tuner);
+
+// For backends only
+void tuner_complete(Tuner *tuner, const Tuner_Result *result);
+
+#endif
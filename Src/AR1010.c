@@ -1,10 +1,42 @@
 #include "AR1010.h"
 #include "stm32f7xx_hal.h"
+#include "cycle_counter.h"
 #include <stdint.h>
 
 #define AR1010_ADDRESS 0x10
 
-uint16_t initialRegisters[18] = {
+#define AR1010_CHAN_BASE		FREQ_MHZ(69, 0)
+#define AR1010_CHAN_SPACING		100 // kHz
+#define AR1010_FREQ_MIN			FM_JAPAN_BOTTOM
+#define AR1010_FREQ_MAX			FM_EUROPE_TOP
+
+#define AR1010_NUM_REGISTERS	18 // R0-R17 are writable
+
+#define AR1010_STC_POLL_INTERVAL	5 // ms
+#define AR1010_TUNE_TIMEOUT			500 // ms
+#define AR1010_SEEK_TIMEOUT			5000 // ms, a wrap around the whole band
+#define AR1010_SEEKTH_MAX			0x7F
+#define AR1010_SEEKTH_DEFAULT		16 // RSSI, as in initialRegisters R3
+
+enum AR1010_Poll_State
+{
+	AR1010_POLL_IDLE,
+	AR1010_POLL_PENDING,
+	AR1010_POLL_DONE,
+	AR1010_POLL_ERROR
+};
+
+enum AR1010_Op_State
+{
+	AR1010_OP_IDLE,
+	AR1010_OP_TUNE,
+	AR1010_OP_AUTO_TUNE_LOW,	// Measuring RSSI with low side injection
+	AR1010_OP_AUTO_TUNE_HIGH,	// Then high side
+	AR1010_OP_AUTO_TUNE_FINAL,	// Retuned with the stronger one
+	AR1010_OP_SEEK
+};
+
+uint16_t initialRegisters[AR1010_NUM_REGISTERS] = {
 	0xFFFB,		// R0:  1111 1111 1111 1011
 	0x5B15,		// R1:  0101 1011 0001 0101 - Mono (D3), Softmute (D2), Hardmute (D1)  !! SOFT-MUTED BY DEFAULT !!
 	0xD0B9,		// R2:  1101 0000 1011 1001 - Tune/Channel
@@ -28,27 +60,83 @@ uint16_t initialRegisters[18] = {
 static uint8_t volume1_conv[19] = {0xF, 0xF, 0xF, 0xF, 0xB, 0xB, 0xB, 0xA, 0x9, 0x8, 0x7, 0x6, 0x6, 0x6, 0x3, 0x3, 0x2, 0x1, 0x0};
 static uint8_t volume2_conv[19] = {0x0, 0xC, 0xD, 0xF, 0xC, 0xD, 0xF, 0xF, 0xF, 0xF, 0xF, 0xD, 0xE, 0xF, 0xE, 0xF, 0xF, 0xF, 0xF};
 
+static uint16_t shadow[AR1010_NUM_REGISTERS]; // Last value written to each register
+static AR1010_Stats stats;
+static uint32_t tune_start_cycles;
+static uint8_t seek_threshold = AR1010_SEEKTH_DEFAULT;
+static uint8_t muted; // Keeps hmute set after each operation, for background use
+static uint8_t op_state = AR1010_OP_IDLE;
+static uint8_t op_auto;
+static uint8_t op_rssi_low;
+static uint32_t op_start;
+static uint32_t op_last_poll;
+static uint32_t op_timeout;
+static AR1010_Callback op_callback;
+static AR1010_Result op_result;
+static uint8_t poll_address = 0x13;
+static uint8_t poll_read[2];
+static volatile uint8_t poll_state = AR1010_POLL_IDLE;
+static uint32_t dirty; // Shadow registers changed but not written yet, one bit per register
+
 static uint8_t reg_write(uint8_t memAddr, uint16_t inputWord);
 static uint16_t reg_read(uint8_t memAddr);
+static void reg_write_burst(uint8_t firstAddr, uint8_t count);
+static void reg_read_burst(uint8_t firstAddr, uint8_t count, uint16_t *words);
+static void reg_flush();
+static void shadow_set(uint8_t memAddr, uint16_t inputWord, uint16_t mask);
 static uint8_t mem_AND(uint8_t memAddr, uint16_t mask);
 static uint8_t mem_OR(uint8_t memAddr, uint16_t mask);
 static uint8_t mem_high(uint8_t memAddr, uint16_t mask);
 static uint8_t mem_low(uint8_t memAddr, uint16_t mask);
 static uint16_t mem_sub_read(uint8_t memAddr, uint16_t mask);
 static uint8_t mem_sub_write(uint8_t memAddr, uint16_t inputWord, uint16_t mask);
+static void start_tune(uint16_t chan, uint8_t auto_inject, AR1010_Callback callback);
+static void start_auto_tune(uint16_t chan);
+static void start_seek(uint8_t auto_inject, AR1010_Callback callback);
+static void add_station(FM_Station_List *list, const AR1010_Result *result);
+static void finish_operation(uint16_t status, uint8_t success);
+static void wait_idle();
+static void on_poll(const I2C_Job *job);
+static void tune_timer_start();
+static void tune_timer_stop();
 
 void AR1010_init()
 {
-	for (uint8_t i = 1; i < 18; i++)
-		reg_write(i, initialRegisters[i]);
-	reg_write(0x00, initialRegisters[0]);
+	for (uint8_t i = 0; i < AR1010_NUM_REGISTERS; i++)
+		shadow[i] = initialRegisters[i];
+	dirty = 0;
+	reg_write_burst(0x01, AR1010_NUM_REGISTERS - 1); // R1-R17, then R0 enables the chip
+	reg_write(0x00, shadow[0]);
 	//while(!memSubRead(0x13, 0x0020));
-	mem_low(0x01, 0x000E); //disable HMUTE and SMUTE
-	mem_sub_write(0x03, 0B11 << 3, 0B11 << 3); //Setup Band and Space
-	mem_sub_write(0x03, 0B1000 << 7, 0B1111 << 7); //Set Volume
+	shadow_set(0x01, 0x0000, 0x000E); //disable HMUTE and SMUTE
+	shadow_set(0x03, 0B11 << 3, 0B11 << 3); //Setup Band and Space
+	shadow_set(0x03, 0B1000 << 7, 0B1111 << 7); //Set Volume
+	reg_flush();
+}
+
+// Reads every writable register back, returns a bit per register that differs from the shadow
+uint32_t AR1010_verify()
+{
+	uint16_t words[AR1010_NUM_REGISTERS];
+	uint32_t mismatch = 0;
+	reg_flush();
+	reg_read_burst(0x00, AR1010_NUM_REGISTERS, words);
+	for (uint8_t i = 0; i < AR1010_NUM_REGISTERS; i++)
+	{
+		if (words[i] != shadow[i])
+			mismatch |= 1 << i;
+	}
+	if (mismatch)
+		stats.verify_failures++;
+	return mismatch;
+}
 
+void AR1010_get_stats(AR1010_Stats *out)
+{
+	*out = stats;
 }
 
+// The I2C transfers complete before returning, the chip needs no settling time between them
 uint8_t reg_write(uint8_t memAddr, uint16_t inputWord)
 {
 	uint8_t upper = (inputWord & 0xFF00) >> 8;
@@ -58,34 +146,89 @@ uint8_t reg_write(uint8_t memAddr, uint16_t inputWord)
 	data[1] = upper;
 	data[2] = lower;
 	I2C_write(AR1010_ADDRESS, data, 3);
-	HAL_Delay(10);
+	if (memAddr < AR1010_NUM_REGISTERS)
+	{
+		shadow[memAddr] = inputWord;
+		dirty &= ~(1 << memAddr);
+	}
+	stats.i2c_writes++;
 	return 0;
 }
 
 uint16_t reg_read(uint8_t memAddr)
 {
-	I2C_write(AR1010_ADDRESS, &memAddr, 1);
 	uint8_t read[2];
-	I2C_read(AR1010_ADDRESS, read, 2);
+	I2C_write_read(AR1010_ADDRESS, &memAddr, 1, read, 2);
 	uint8_t upper = read[0];
 	uint8_t lower = read[1];
 	uint16_t outputWord = (upper << 8) + lower;
-	HAL_Delay(10);
+	stats.i2c_reads++;
 	return outputWord;
 }
 
+// The register address auto-increments, so a contiguous range goes in one transfer
+void reg_write_burst(uint8_t firstAddr, uint8_t count)
+{
+	uint8_t data[1 + AR1010_NUM_REGISTERS * 2];
+	data[0] = firstAddr;
+	for (uint8_t i = 0; i < count; i++)
+	{
+		data[1 + i * 2] = shadow[firstAddr + i] >> 8;
+		data[2 + i * 2] = shadow[firstAddr + i] & 0xFF;
+		dirty &= ~(1 << (firstAddr + i));
+	}
+	I2C_write(AR1010_ADDRESS, data, 1 + count * 2);
+	stats.i2c_writes++;
+}
+
+void reg_read_burst(uint8_t firstAddr, uint8_t count, uint16_t *words)
+{
+	uint8_t read[AR1010_NUM_REGISTERS * 2];
+	I2C_write_read(AR1010_ADDRESS, &firstAddr, 1, read, count * 2);
+	for (uint8_t i = 0; i < count; i++)
+		words[i] = (read[i * 2] << 8) + read[i * 2 + 1];
+	stats.i2c_reads++;
+}
+
+// Writes every dirty register, plus any clean ones between them, in one burst
+void reg_flush()
+{
+	if (!dirty)
+		return;
+	uint8_t first = __builtin_ctz(dirty);
+	uint8_t last = 31 - __builtin_clz(dirty);
+	reg_write_burst(first, last - first + 1);
+}
+
+// Updates a field in the shadow only, reg_flush sends it
+void shadow_set(uint8_t memAddr, uint16_t inputWord, uint16_t mask)
+{
+	uint16_t outputWord = (shadow[memAddr] & ~mask) | (inputWord & mask);
+	if (outputWord == shadow[memAddr])
+		return;
+	shadow[memAddr] = outputWord;
+	dirty |= 1 << memAddr;
+}
+
+// Writable registers only change when we write them, so field updates work on the shadow copy
+static uint8_t shadow_write(uint8_t memAddr, uint16_t inputWord)
+{
+	if (shadow[memAddr] == inputWord && !(dirty & (1 << memAddr)))
+	{
+		stats.skipped_writes++;
+		return 0;
+	}
+	return reg_write(memAddr, inputWord);
+}
+
 uint8_t mem_AND(uint8_t memAddr, uint16_t mask)
 {
-	uint16_t opWord = reg_read(memAddr);
-	opWord = opWord & mask;
-	return reg_write(memAddr, opWord);
+	return shadow_write(memAddr, shadow[memAddr] & mask);
 }
 
 uint8_t mem_OR(uint8_t memAddr, uint16_t mask)
 {
-	uint16_t opWord = reg_read(memAddr);
-	opWord |= mask;
-	return reg_write(memAddr, opWord);
+	return shadow_write(memAddr, shadow[memAddr] | mask);
 }
 
 uint8_t mem_high(uint8_t memAddr, uint16_t mask)
@@ -98,116 +241,335 @@ uint8_t mem_low(uint8_t memAddr, uint16_t mask)
 	return mem_AND(memAddr, ~mask);
 }
 
+// Status registers (RSSI, READCHAN, STC...) are past the shadow and always come from the chip
 uint16_t mem_sub_read(uint8_t memAddr, uint16_t mask)
 {
-	uint16_t opWord = reg_read(memAddr);
+	uint16_t opWord = memAddr < AR1010_NUM_REGISTERS ? shadow[memAddr] : reg_read(memAddr);
 	return opWord & mask;
 }
 
 uint8_t mem_sub_write(uint8_t memAddr, uint16_t inputWord, uint16_t mask)
 {
-	uint16_t opWord = reg_read(memAddr);
-	opWord = opWord & ~mask;
+	uint16_t opWord = shadow[memAddr] & ~mask;
 	inputWord = inputWord & mask;
 	uint16_t outputWord = opWord | inputWord;
-	return reg_write(memAddr, outputWord);
+	return shadow_write(memAddr, outputWord);
 }
 
-void AR1010_scan(uint16_t lower, uint16_t upper)
+static void tune_timer_start()
 {
-	uint16_t i;
-	for (i = lower; i <= upper; i++)
+	tune_start_cycles = CPU_CYCLES;
+}
+
+static void tune_timer_stop()
+{
+	uint32_t us = (CPU_CYCLES - tune_start_cycles) / (SystemCoreClock / 1000000);
+	stats.tunes++;
+	stats.last_tune_time = us;
+	if (us > stats.max_tune_time)
+		stats.max_tune_time = us;
+}
+
+// Hops between stations with the hardware seek, each stop is already over the seek threshold
+uint8_t AR1010_scan(Freq_kHz lower, Freq_kHz upper, FM_Station_List *list)
+{
+	FM_stations_clear(list);
+	uint32_t start = HAL_GetTick();
+
+	AR1010_tune(freq_snap(BAND_FM_EUROPE, lower)); // Seek starts from the next channel, so check the band edge first
+	if (op_result.rssi >= seek_threshold)
+		add_station(list, &op_result);
+
+	uint16_t last_chan = op_result.chan;
+	for (uint16_t i = 0; i < freq_rasters[BAND_FM_EUROPE].channels; i++)
 	{
-		AR1010_tune((float) (i * 0.1), 1);
-		HAL_Delay(500);
+		start_seek(0, 0);
+		wait_idle();
+		if (!op_result.success || op_result.chan <= last_chan || op_result.freq > upper)
+			break; // Hit the band edge, or wrapped around
+		last_chan = op_result.chan;
+		add_station(list, &op_result);
 	}
-	// !!!
+
+	FM_stations_rank(list);
+	list->scan_time = HAL_GetTick() - start;
+	return list->size;
 }
 
-void AR1010_tune(float freq, uint8_t convert)
-{ //freq in MHz as a float
-	uint16_t chan;
-	if (convert)
-		chan = (uint16_t) (freq * 10 - 690);
-	else
-		chan = (uint16_t) freq;
+void AR1010_set_seek_threshold(uint8_t threshold)
+{
+	if (threshold > AR1010_SEEKTH_MAX)
+		threshold = AR1010_SEEKTH_MAX;
+	seek_threshold = threshold;
+}
 
-	mem_high(0x01, 0x0002);                //Set hmute
-	mem_low(0x02, 0x0200);                 //Clear TUNE
-	mem_low(0x03, 0x4000);                 //Clear SEEK
-	mem_sub_write(0x02, chan, 0x01FF);      //Set CHAN
-	mem_high(0x02, 0x0200);                //Enable TUNE
-	while (!mem_sub_read(0x13, 0x0020))
-		;     //Wait STC
-	mem_low(0x01, 0x0002);                 //Clear hmute
-}
-
-void AR1010_auto_tune(float freq, uint8_t convert)
-{ //freq in MHz as float
-	uint16_t chan;
-	if (convert)
-		chan = (uint16_t) (freq * 10 - 690);
-	else
-		chan = (uint16_t) freq;
-
-	mem_high(0x01, 0x0002);										//Set hmute
-	mem_low(0x02, 0x0200);										//Clear TUNE
-	mem_low(0x03, 0x4000);										//Clear SEEK
-	mem_sub_write(0x02, chan, 0x01FF);							//Set CHAN
-														//Read Low-side LO injection
-	mem_sub_write(0x0B, 0x0000, 0x8005);							//Set R11 (Clear D15, Clear D0/D2)
-	mem_high(0x02, 0x0200);										//Enable TUNE
-	while (!mem_sub_read(0x13, 0x0020))
-		;                   //Wait for STC flag
-	uint8_t RSSI1 = mem_sub_read(0x12, 0xFE00);					//Get RSSI1
-	mem_low(0x02, 0x0200);										//Clear TUNE
-														//Read High-side LO injection
-	mem_sub_write(0x0B, 0x8005, 0x8005);							//Set R11 (Set D15, Set D0/D2)
-	mem_high(0x02, 0x0200);										//Enable TUNE
-	while (!mem_sub_read(0x13, 0x0020))
-		;                   //Wait for STC flag
-	uint8_t RSSI2 = mem_sub_read(0x12, 0xFE00);					//Get RSSI2
-	mem_low(0x02, 0x0200);										//Clear TUNE
-														//Compare Hi-Lo strength
-	if (RSSI1 > RSSI2)
-		mem_sub_write(0x0B, 0x0005, 0x8005);						//(RSSI1>RSSI2)?R11(Clear D15, Set D0/D2)
-	else
-		mem_sub_write(0x0B, 0x0000, 0x8000);						//:R11(Set D11, Clear D0/D2)
-	mem_high(0x02, 0x0200);										//Enable TUNE
-	while (!mem_sub_read(0x13, 0x0020));							//Wait STC
-	mem_low(0x01, 0x0002);										//Clear hmute
+// CHAN counts 100 kHz steps from 69 MHz. Out of band frequencies are clamped to the band edge
+uint16_t AR1010_channel(Freq_kHz freq)
+{
+	if (freq < AR1010_FREQ_MIN)
+		freq = AR1010_FREQ_MIN;
+	if (freq > AR1010_FREQ_MAX)
+		freq = AR1010_FREQ_MAX;
+	return (freq - AR1010_CHAN_BASE) / AR1010_CHAN_SPACING;
+}
+
+Freq_kHz AR1010_channel_freq(uint16_t chan)
+{
+	return AR1010_CHAN_BASE + (Freq_kHz) chan * AR1010_CHAN_SPACING;
+}
+
+void AR1010_tune(Freq_kHz freq)
+{
+	AR1010_tune_channel(AR1010_channel(freq));
+}
+
+void AR1010_tune_channel(uint16_t chan)
+{
+	wait_idle(); // Lets an async operation finish first
+	start_tune(chan, 0, 0);
+	wait_idle();
+}
+
+void AR1010_auto_tune(Freq_kHz freq)
+{
+	AR1010_auto_tune_channel(AR1010_channel(freq));
+}
+
+void AR1010_auto_tune_channel(uint16_t chan)
+{
+	wait_idle();
+	start_tune(chan, 1, 0);
+	wait_idle();
 }
 
 void AR1010_seek()
 { //NEEDS WORK
-	mem_high(0x01, 0x0002);                                  //Set hmute
-	mem_low(0x02, 0x0200);                                   //Clear TUNE
-	mem_sub_write(0x02, mem_sub_read(0x13, 0xFF80) >> 7, 0x01FF); //Set CHAN = READCHAN
-	mem_low(0x03, 0x4000);                                   //Clear SEEK
-	mem_high(0x03, 0x8010);                   //Set SEEKUP/SEEKTH !!!TWEAK SEEKTH
-	mem_high(0x03, 0x4000);                                  //Enable SEEK
-	while (!mem_sub_read(0x13, 0x0020));                       //Wait STC
-	mem_low(0x01, 0x0002);                                   //Clear hmute
+	wait_idle();
+	start_seek(0, 0);
+	wait_idle();
 }
 
 void AR1010_auto_seek()
 { //NEEDS WORK
-	mem_high(0x01, 0x0002);                                  //Set hmute
-	mem_low(0x02, 0x0200);                                   //Clear TUNE
-	mem_sub_write(0x02, mem_sub_read(0x13, 0xFF80) >> 7, 0x01FF); //Set CHAN = READCHAN
-	mem_low(0x03, 0x4000);                                   //Clear SEEK
-	mem_high(0x03, 0x8010);                   //Set SEEKUP/SEEKTH !!!TWEAK SEEKTH
+	wait_idle();
+	start_seek(1, 0);
+	wait_idle();
+}
+
+// The async versions return 1 without starting if an operation is already running
+uint8_t AR1010_tune_async(Freq_kHz freq, AR1010_Callback callback)
+{
+	if (op_state != AR1010_OP_IDLE)
+		return 1;
+	start_tune(AR1010_channel(freq), 0, callback);
+	return 0;
+}
+
+uint8_t AR1010_auto_tune_async(Freq_kHz freq, AR1010_Callback callback)
+{
+	if (op_state != AR1010_OP_IDLE)
+		return 1;
+	start_tune(AR1010_channel(freq), 1, callback);
+	return 0;
+}
+
+uint8_t AR1010_seek_async(AR1010_Callback callback)
+{
+	if (op_state != AR1010_OP_IDLE)
+		return 1;
+	start_seek(0, callback);
+	return 0;
+}
+
+uint8_t AR1010_auto_seek_async(AR1010_Callback callback)
+{
+	if (op_state != AR1010_OP_IDLE)
+		return 1;
+	start_seek(1, callback);
+	return 0;
+}
+
+uint8_t AR1010_busy()
+{
+	return op_state != AR1010_OP_IDLE;
+}
+
+// Polls STC at most every AR1010_STC_POLL_INTERVAL, so the bus stays free for the Si468x in between
+void AR1010_task()
+{
+	if (op_state == AR1010_OP_IDLE || poll_state == AR1010_POLL_PENDING)
+		return;
+	uint32_t tick = HAL_GetTick();
+	if (poll_state == AR1010_POLL_IDLE)
+	{
+		if (tick - op_last_poll < AR1010_STC_POLL_INTERVAL)
+			return;
+		op_last_poll = tick;
+		// The read runs on the I2C queue, a later call picks up the result
+		I2C_Job job = {AR1010_ADDRESS, &poll_address, 1, poll_read, 2, on_poll};
+		poll_state = AR1010_POLL_PENDING;
+		if (i2c_queue_submit(&job))
+			poll_state = AR1010_POLL_IDLE;
+		return;
+	}
+
+	uint16_t status = poll_state == AR1010_POLL_DONE ? (poll_read[0] << 8) + poll_read[1] : 0;
+	poll_state = AR1010_POLL_IDLE;
+	stats.i2c_reads++;
+	if (!(status & 0x0020)) //Wait STC
+	{
+		if (tick - op_start > op_timeout)
+			finish_operation(status, 0);
+		return;
+	}
+
+	switch (op_state)
+	{
+	case AR1010_OP_AUTO_TUNE_LOW:
+		op_rssi_low = mem_sub_read(0x12, 0xFE00) >> 9;			//Get RSSI1
+		shadow_set(0x02, 0x0000, 0x0200);							//Clear TUNE
+																//Read High-side LO injection
+		shadow_set(0x0B, 0x8005, 0x8005);							//Set R11 (Set D15, Set D0/D2)
+		reg_flush();
+		mem_high(0x02, 0x0200);										//Enable TUNE
+		op_state = AR1010_OP_AUTO_TUNE_HIGH;
+		break;
+	case AR1010_OP_AUTO_TUNE_HIGH:
+	{
+		uint8_t rssi_high = mem_sub_read(0x12, 0xFE00) >> 9;		//Get RSSI2
+		shadow_set(0x02, 0x0000, 0x0200);							//Clear TUNE
+																//Compare Hi-Lo strength
+		if (op_rssi_low > rssi_high)
+			shadow_set(0x0B, 0x0005, 0x8005);						//(RSSI1>RSSI2)?R11(Clear D15, Set D0/D2)
+		else
+			shadow_set(0x0B, 0x0000, 0x8000);						//:R11(Set D11, Clear D0/D2)
+		reg_flush();
+		mem_high(0x02, 0x0200);										//Enable TUNE
+		op_state = AR1010_OP_AUTO_TUNE_FINAL;
+		break;
+	}
+	case AR1010_OP_SEEK:
+		if (status & 0x0010) //SF, nothing found
+			finish_operation(status, 0);
+		else if (op_auto)
+		{
+			// The injection legs are a tune of their own, timed and timed out as one
+			tune_timer_start();
+			op_start = tick;
+			op_timeout = AR1010_TUNE_TIMEOUT;
+			start_auto_tune(status >> 7); //autoTune with READCHAN
+		}
+		else
+			finish_operation(status, 1);
+		break;
+	default:
+		finish_operation(status, 1);
+		break;
+	}
+}
+
+void start_tune(uint16_t chan, uint8_t auto_inject, AR1010_Callback callback)
+{
+	tune_timer_start();
+	op_callback = callback;
+	op_auto = auto_inject;
+	op_start = HAL_GetTick();
+	op_last_poll = op_start;
+	op_timeout = AR1010_TUNE_TIMEOUT;
+	if (auto_inject)
+	{
+		start_auto_tune(chan);
+		return;
+	}
+	shadow_set(0x01, 0x0002, 0x0002);      //Set hmute
+	shadow_set(0x02, chan, 0x03FF);        //Set CHAN, clear TUNE
+	shadow_set(0x03, 0x0000, 0x4000);      //Clear SEEK
+	reg_flush();
+	mem_high(0x02, 0x0200);                //Enable TUNE
+	op_state = AR1010_OP_TUNE;
+}
+
+void start_auto_tune(uint16_t chan)
+{
+	shadow_set(0x01, 0x0002, 0x0002);							//Set hmute
+	shadow_set(0x02, chan, 0x03FF);								//Set CHAN, clear TUNE
+	shadow_set(0x03, 0x0000, 0x4000);							//Clear SEEK
+															//Read Low-side LO injection
+	shadow_set(0x0B, 0x0000, 0x8005);							//Set R11 (Clear D15, Clear D0/D2)
+	reg_flush();
+	mem_high(0x02, 0x0200);										//Enable TUNE
+	op_state = AR1010_OP_AUTO_TUNE_LOW;
+}
+
+void start_seek(uint8_t auto_inject, AR1010_Callback callback)
+{
+	tune_timer_start();
+	op_callback = callback;
+	op_auto = auto_inject;
+	op_start = HAL_GetTick();
+	op_last_poll = op_start;
+	op_timeout = AR1010_SEEK_TIMEOUT;
+	shadow_set(0x01, 0x0002, 0x0002);                        //Set hmute
+	shadow_set(0x02, mem_sub_read(0x13, 0xFF80) >> 7, 0x03FF); //Set CHAN = READCHAN, clear TUNE
+	shadow_set(0x03, 0x8000 | seek_threshold, 0xC07F);       //Set SEEKUP/SEEKTH, clear SEEK
+	reg_flush();
 	mem_high(0x03, 0x4000);                                  //Enable SEEK
-	while (!mem_sub_read(0x13, 0x0020));                       //Wait STC
-	if (!mem_sub_read(0x13, 0x0010))                           //If !SF
-		AR1010_auto_tune((float) (mem_sub_read(0x13, 0xFF80) >> 7), 0); //autoTune with READCHAN                                             //
-	mem_low(0x01, 0x0002);                                   //Clear hmute
+	op_state = AR1010_OP_SEEK;
+}
+
+// The AR1010 has no RDS or SNR readout, stations are ranked by RSSI alone
+void add_station(FM_Station_List *list, const AR1010_Result *result)
+{
+	FM_Station station;
+	station.freq = result->freq;
+	station.pi = FM_NO_PI;
+	station.rssi = result->rssi;
+	station.snr = 0;
+	station.multipath = 0;
+	FM_stations_add(list, &station);
+}
+
+void finish_operation(uint16_t status, uint8_t success)
+{
+	if (!muted)
+		mem_low(0x01, 0x0002);             //Clear hmute
+	op_state = AR1010_OP_IDLE;
+	tune_timer_stop();
+
+	op_result.success = success;
+	op_result.chan = status >> 7;
+	op_result.freq = AR1010_channel_freq(op_result.chan);
+	op_result.rssi = mem_sub_read(0x12, 0xFE00) >> 9;
+	op_result.stereo = (status & 0x0008) != 0;
+	if (!success)
+		stats.failed_tunes++;
+	if (op_callback)
+		op_callback(&op_result);
+}
+
+void on_poll(const I2C_Job *job)
+{
+	poll_state = job->status == I2C_JOB_DONE ? AR1010_POLL_DONE : AR1010_POLL_ERROR;
+}
+
+// The blocking calls run the same state machine, polling at the same bounded rate
+void wait_idle()
+{
+	while (op_state != AR1010_OP_IDLE)
+		AR1010_task();
+}
+
+void AR1010_set_mute(uint8_t mute)
+{
+	muted = mute;
+	if (op_state == AR1010_OP_IDLE) // Otherwise finish_operation applies it
+		mem_sub_write(0x01, mute ? 0x0002 : 0x0000, 0x0002);
 }
 
 void AR1010_set_volume(uint8_t volume)
 {
-	if (volume > 18)
-		volume = 18;
+	if (volume > AR1010_MAX_VOLUME)
+		volume = AR1010_MAX_VOLUME;
 	int write1 = volume1_conv[volume];
 	int write2 = volume2_conv[volume];
 	mem_sub_write(0x03, write1 << 7, 0B1111 << 7);
@@ -0,0 +1,107 @@
+#include "FM_stations.h"
+#include <stdlib.h>
+#include "stream_utils.h"
+#include "flash_map.h"
+#include "flash_kv.h"
+
+#define FM_STATION_RECORD_SIZE	7
+#define FM_STATIONS_HEADER_SIZE	7 // Stream length, count, scan time
+
+void FM_stations_clear(FM_Station_List *list)
+{
+	list->size = 0;
+	list->scan_time = 0;
+}
+
+// Returns 1 if the station was added or replaced a weaker copy of the same programme
+uint8_t FM_stations_add(FM_Station_List *list, const FM_Station *station)
+{
+	if (station->pi != FM_NO_PI)
+	{
+		for (uint8_t i = 0; i < list->size; i++)
+		{
+			if (list->stations[i].pi != station->pi)
+				continue;
+			if (FM_stations_score(station) <= FM_stations_score(&list->stations[i]))
+				return 0;
+			list->stations[i] = *station; // Same programme on a better frequency
+			return 1;
+		}
+	}
+
+	if (list->size >= FM_MAX_STATIONS)
+		return 0;
+	list->stations[list->size++] = *station;
+	return 1;
+}
+
+int16_t FM_stations_score(const FM_Station *station)
+{
+	// SNR matters most for audible quality, multipath costs up to 12 dB
+	return 2 * station->snr + station->rssi - station->multipath / 8;
+}
+
+void FM_stations_rank(FM_Station_List *list)
+{
+	// Insertion sort, the list is small and mostly in frequency order
+	for (uint8_t i = 1; i < list->size; i++)
+	{
+		FM_Station station = list->stations[i];
+		int16_t score = FM_stations_score(&station);
+		uint8_t j = i;
+		for (; j > 0 && FM_stations_score(&list->stations[j - 1]) < score; j--)
+			list->stations[j] = list->stations[j - 1];
+		list->stations[j] = station;
+	}
+}
+
+void FM_stations_save(const FM_Station_List *list)
+{
+	Stream *stream = stream_create();
+	stream_write_uint8(stream, list->size);
+	stream_write_uint32(stream, list->scan_time);
+	for (uint8_t i = 0; i < list->size; i++)
+	{
+		const FM_Station *station = &list->stations[i];
+		stream_write_uint16(stream, station->freq / 10); // 10 kHz fits every FM raster in 16 bits
+		stream_write_uint16(stream, station->pi);
+		stream_write_uint8(stream, station->rssi);
+		stream_write_uint8(stream, station->snr);
+		stream_write_uint8(stream, station->multipath);
+	}
+	stream_flush(stream);
+	flash_kv_write(FLASH_KEY_FM_STATIONS, stream->data, stream->data_size);
+	stream_free(stream);
+}
+
+uint8_t FM_stations_load(FM_Station_List *list)
+{
+	FM_stations_clear(list);
+
+	uint16_t stream_size = flash_kv_size(FLASH_KEY_FM_STATIONS);
+	if (stream_size < FM_STATIONS_HEADER_SIZE || stream_size > FM_STATIONS_HEADER_SIZE + FM_MAX_STATIONS * FM_STATION_RECORD_SIZE)
+		return 0; // Never saved or corrupt
+
+	uint8_t *data = malloc(stream_size);
+	flash_kv_read(FLASH_KEY_FM_STATIONS, data, stream_size);
+	Stream *stream = stream_load(data, stream_size);
+
+	uint8_t size = stream_read_uint8(stream);
+	uint32_t scan_time = stream_read_uint32(stream);
+	if (size <= FM_MAX_STATIONS && stream_size == FM_STATIONS_HEADER_SIZE + size * FM_STATION_RECORD_SIZE)
+	{
+		for (uint8_t i = 0; i < size; i++)
+		{
+			FM_Station *station = &list->stations[i];
+			station->freq = (Freq_kHz) stream_read_uint16(stream) * 10;
+			station->pi = stream_read_uint16(stream);
+			station->rssi = stream_read_uint8(stream);
+			station->snr = stream_read_uint8(stream);
+			station->multipath = stream_read_uint8(stream);
+		}
+		list->size = size;
+		list->scan_time = scan_time;
+	}
+	stream_free(stream);
+	return list->size;
+}
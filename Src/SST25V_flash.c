@@ -1,6 +1,10 @@
 #include "SST25V_flash.h"
 #include "gpio.h"
 #include "spi.h"
+#include "dma_pool.h"
+#include "cycle_counter.h"
+#include <stddef.h>
+#include <string.h>
 
 #define FLASH_READ_SLOW				0x03
 #define FLASH_READ_FAST				0x0B
@@ -18,8 +22,58 @@
 #define FLASH_SBIT_BUSY				0x01
 #define FLASH_SBIT_WRITE_ENABLE		0x01
 
-#define DWT_CYCCNT ((volatile uint32_t *)0xE0001004)
-#define CPU_CYCLES *DWT_CYCCNT
+#define SST25_DMA_MIN				16 // Shorter blocking reads are cheaper polled than set up as DMA
+
+#define PAGE_OF(address) ((address) & ~(SST25_CACHE_PAGE_SIZE - 1))
+
+// Each step is one chip select cycle, advance() picks the next one from the SPI DMA callback
+enum SST25_Step
+{
+	STEP_IDLE,
+	STEP_READ,
+	STEP_AAI_EBSY,
+	STEP_AAI_ENABLE,
+	STEP_AAI_WORD,
+	STEP_AAI_WAIT,		// Hardware end-of-write, CS held low and SO raises the EXTI once the word is programmed
+	STEP_AAI_DISABLE,
+	STEP_AAI_DBSY,
+	STEP_BYTE_ENABLE,
+	STEP_BYTE_PROGRAM,
+	STEP_BYTE_POLL
+};
+
+enum Cache_Page_State
+{
+	PAGE_EMPTY,
+	PAGE_FILLING,	// DMA into the page in flight
+	PAGE_VALID
+};
+
+typedef struct
+{
+	uint32_t address;
+	uint32_t last_used;
+	uint8_t *data;
+	volatile uint8_t state;
+	uint8_t read_ahead;		// Filled ahead of the reader and not looked up yet
+} Cache_Page;
+
+static volatile uint8_t step = STEP_IDLE;
+static volatile uint8_t erasing; // Sector erase issued, the chip answers nothing but RDSR until BUSY clears
+static SST25_Callback callback;
+static void *callback_context;
+static uint32_t op_address;
+static const uint8_t *op_data;
+static uint8_t *op_buffer;
+static uint16_t op_size;
+static uint16_t op_written;
+static uint8_t word_size; // Next AAI word, prepared in the control buffer while the previous one programs
+static uint32_t op_start;
+static uint8_t *control; // Command and status bytes, from the DMA pool
+static SST25_Stats stats;
+static Cache_Page cache[SST25_CACHE_PAGES];
+static uint32_t cache_tick;
+static uint32_t last_page = 0xFFFFFFFF; // Page touched last by SST25_read, to spot sequential reads
 
 static void SST25_start();
 static void SST25_end();
@@ -28,10 +82,57 @@ static void SST25_enable_hardware_EOW();
 static void SST25_write_enable();
 static void SST25_write_status(uint8_t status);
 static void delay();
+static void wait_idle();
+static uint8_t claim(uint8_t first_step);
+static void transfer(uint8_t next_step, uint16_t tx_size, uint16_t rx_size);
+static void send_command(uint8_t next_step, uint8_t command);
+static void prepare_aai_word();
+static void wait_ready();
+static void stop_waiting();
+static void send_byte_program();
+static void poll(uint8_t next_step);
+static void advance();
+static void finish(uint8_t error);
+static void set_address(uint8_t *cmd, uint32_t address);
+static uint32_t cycles_to_us(uint32_t cycles);
+static void blocking_done(uint8_t error, void *context);
+static void reader_done(uint8_t error, void *context);
+static void reader_request(SST25_Reader *reader, uint8_t index);
+static void read_direct(uint32_t address, uint8_t *read_buffer, uint16_t size);
+static Cache_Page *cache_find(uint32_t page_address);
+static Cache_Page *cache_lookup(uint32_t page_address);
+static Cache_Page *cache_victim();
+static void cache_invalidate(uint32_t address, uint32_t size);
+static void read_ahead(uint32_t page_address);
+static void page_filled(uint8_t error, void *context);
+
+void SST25_init()
+{
+	control = (uint8_t *) dma_pool_alloc(DMA_POOL_SLOT_SIZE);
+
+	// Pages come from the pool so fills go by DMA. Without them every read goes to the flash
+	uint8_t *pages = (uint8_t *) dma_pool_alloc(SST25_CACHE_PAGES * SST25_CACHE_PAGE_SIZE);
+	for (uint8_t i = 0; pages && i < SST25_CACHE_PAGES; i++)
+		cache[i].data = pages + i * SST25_CACHE_PAGE_SIZE;
+
+	// SO is the SPI3 MISO pin, the EXTI sees it through the input stage while it stays in alternate function mode
+	SYSCFG->EXTICR[2] = (SYSCFG->EXTICR[2] & ~SYSCFG_EXTICR3_EXTI11) | SYSCFG_EXTICR3_EXTI11_PC;
+	stop_waiting();
+}
 
 void SST25_sector_erase_4K(uint32_t address)
 {
+	SST25_sector_erase_4K_start(address);
+	while (SST25_erase_busy())
+		;
+}
+
+// Returns once the erase command is in, poll SST25_erase_busy for the end. Other calls wait for it on their own
+void SST25_sector_erase_4K_start(uint32_t address)
+{
+	wait_idle();
 	address &= 0xFFFFFF;
+	cache_invalidate(address & ~0xFFF, 0x1000);
 
 	SST25_write_status(0x00); // Clear all sector protection
 	SST25_write_enable();
@@ -45,8 +146,18 @@ void SST25_sector_erase_4K(uint32_t address)
 	};
 	flash_SPI_write(cmd, 4);
 	SST25_end();
+	erasing = 1;
+}
 
-	while (SST25_get_status() & FLASH_SBIT_BUSY);
+// One status read per call while an erase runs
+uint8_t SST25_erase_busy()
+{
+	if (!erasing)
+		return 0;
+	if (SST25_get_status() & FLASH_SBIT_BUSY)
+		return 1;
+	erasing = 0;
+	return 0;
 }
 
 void SST25_enable_hardware_EOW()
@@ -92,10 +203,12 @@ uint8_t SST25_get_status()
 
 void SST25_write_byte(uint32_t address, uint8_t data)
 {
+	wait_idle();
 	if (!(SST25_get_status() & FLASH_SBIT_WRITE_ENABLE))
 		SST25_write_enable();
 
 	address &= 0xFFFFFF;
+	cache_invalidate(address, 1);
 
 	SST25_start();
 	uint8_t cmd[] = {
@@ -111,12 +224,26 @@ void SST25_write_byte(uint32_t address, uint8_t data)
 
 void SST25_write(uint32_t address, uint8_t *data, uint16_t size)
 {
+	volatile uint8_t done = 0;
+	wait_idle();
+	while (SST25_write_async(address, data, size, blocking_done, (void *) &done))
+		;
+	while (size && !done)
+		;
+}
+
+// The AAI loop from before the interrupt engine, busy-waits on SO after every word. Kept to compare write rates
+void SST25_write_polled(uint32_t address, uint8_t *data, uint16_t size)
+{
+	wait_idle();
+	uint32_t start = CPU_CYCLES;
 	if (!(SST25_get_status() & FLASH_SBIT_WRITE_ENABLE))
 		SST25_write_enable();
 
 	SST25_enable_hardware_EOW();
 
 	address &= 0xFFFFFF;
+	cache_invalidate(address, size);
 	uint8_t address_cmd[] = {
 			FLASH_AAI,
 			(address >> 16) & 0xFF,
@@ -154,12 +281,62 @@ void SST25_write(uint32_t address, uint8_t *data, uint16_t size)
 	SST25_end();
 
 	if (remaining)
+	{
 		SST25_write_byte(address + written, data[written]);
+		while (SST25_get_status() & FLASH_SBIT_BUSY);
+		written++;
+	}
+
+	stats.writes++;
+	stats.bytes_written += written;
+	stats.write_time += cycles_to_us(CPU_CYCLES - start);
 }
 
+// Short reads are copied out of the page cache, and reading on from the last page starts a read-ahead of the next
 void SST25_read(uint32_t address, uint8_t *read_buffer, uint16_t size)
 {
 	address &= 0xFFFFFF;
+	if (!cache[0].data || size > SST25_CACHE_PAGE_SIZE)
+	{
+		stats.cache_bypasses++;
+		read_direct(address, read_buffer, size);
+		return;
+	}
+
+	uint8_t sequential = PAGE_OF(address) == last_page || PAGE_OF(address) == last_page + SST25_CACHE_PAGE_SIZE;
+	while (size)
+	{
+		Cache_Page *page = cache_lookup(PAGE_OF(address));
+		uint16_t offset = address - page->address;
+		uint16_t count = SST25_CACHE_PAGE_SIZE - offset;
+		if (count > size)
+			count = size;
+		memcpy(read_buffer, page->data + offset, count);
+		read_buffer += count;
+		address += count;
+		size -= count;
+		last_page = page->address;
+	}
+	if (sequential)
+		read_ahead(last_page + SST25_CACHE_PAGE_SIZE);
+}
+
+// Pool buffers go by DMA, anything else is polled so the cache never needs maintaining around the transfer
+void read_direct(uint32_t address, uint8_t *read_buffer, uint16_t size)
+{
+	wait_idle();
+	if (size >= SST25_DMA_MIN && dma_pool_contains(read_buffer, size))
+	{
+		volatile uint8_t done = 0;
+		while (SST25_read_async(address, read_buffer, size, blocking_done, (void *) &done))
+			;
+		while (!done)
+			;
+		return;
+	}
+
+	uint32_t start = CPU_CYCLES;
+	address &= 0xFFFFFF;
 
 	SST25_start();
 	uint8_t cmd[] = {
@@ -172,6 +349,476 @@ void SST25_read(uint32_t address, uint8_t *read_buffer, uint16_t size)
 	flash_SPI_write(cmd, 5);
 	flash_SPI_read(read_buffer, size);
 	SST25_end();
+
+	stats.reads++;
+	stats.bytes_read += size;
+	stats.read_time += cycles_to_us(CPU_CYCLES - start);
+}
+
+uint8_t SST25_read_async(uint32_t address, uint8_t *read_buffer, uint16_t size, SST25_Callback done, void *context)
+{
+	if (claim(STEP_READ))
+		return 1;
+
+	callback = done;
+	callback_context = context;
+	op_buffer = read_buffer;
+	op_size = size;
+	op_start = CPU_CYCLES;
+	if (!dma_pool_contains(read_buffer, size))
+	{
+		stats.unpooled++;
+		SCB_CleanInvalidateDCache_by_Addr((void *) read_buffer, size);
+	}
+
+	control[0] = FLASH_READ_FAST;
+	set_address(control + 1, address);
+	control[4] = 0xFF; // Dummy byte
+	SST25_start();
+	if (HAL_SPI_Transmit(&hspi3, control, 5, 10) != HAL_OK // Shorter than a DMA set up
+			|| HAL_SPI_Receive_DMA(&hspi3, read_buffer, size) != HAL_OK)
+	{
+		SST25_end();
+		finish(1);
+	}
+	return 0;
+}
+
+// Runs the AAI sequence from the DMA and SO ready interrupts, the odd last byte goes in with a byte program
+uint8_t SST25_write_async(uint32_t address, const uint8_t *data, uint16_t size, SST25_Callback done, void *context)
+{
+	if (!size)
+		return 0;
+	if (claim(STEP_AAI_ENABLE))
+		return 1;
+
+	callback = done;
+	callback_context = context;
+	op_address = address & 0xFFFFFF;
+	op_data = data;
+	op_size = size;
+	op_written = 0;
+	op_start = CPU_CYCLES;
+	cache_invalidate(op_address, size); // No fill can be in flight once the bus is claimed
+	if (size > 1)
+		send_command(STEP_AAI_EBSY, FLASH_ENABLE_SO);
+	else
+		send_command(STEP_BYTE_ENABLE, FLASH_WRITE_ENABLE);
+	return 0;
+}
+
+uint8_t SST25_busy()
+{
+	return step != STEP_IDLE || erasing;
+}
+
+// Starts the first two chunks. Returns 1 if the DMA pool has no room for the buffers
+uint8_t SST25_reader_open(SST25_Reader *reader, uint32_t address, uint32_t size)
+{
+	reader->address = address;
+	reader->remaining = size;
+	reader->current = 0;
+	reader->buffers[0] = (uint8_t *) dma_pool_alloc(SST25_READ_CHUNK);
+	reader->buffers[1] = (uint8_t *) dma_pool_alloc(SST25_READ_CHUNK);
+	if (!reader->buffers[0] || !reader->buffers[1])
+	{
+		SST25_reader_close(reader);
+		return 1;
+	}
+
+	reader->sizes[1] = 0;
+	reader_request(reader, 0);
+	return 0;
+}
+
+// Waits for the chunk in flight and starts fetching the one after it. NULL once everything has been returned
+const uint8_t *SST25_reader_next(SST25_Reader *reader, uint16_t *size)
+{
+	uint8_t index = reader->current;
+	if (!reader->sizes[index])
+	{
+		*size = 0;
+		return NULL;
+	}
+	while (!reader->ready[index])
+		;
+
+	// The other buffer was handed out by the previous call, the caller is done with it now
+	reader->sizes[index ^ 1] = 0;
+	if (reader->remaining)
+		reader_request(reader, index ^ 1);
+	reader->current = index ^ 1;
+	*size = reader->sizes[index];
+	return reader->buffers[index];
+}
+
+void SST25_reader_close(SST25_Reader *reader)
+{
+	for (uint8_t i = 0; i < 2; i++)
+	{
+		if (reader->buffers[i] && reader->sizes[i])
+			while (!reader->ready[i])
+				;
+		dma_pool_free(reader->buffers[i]);
+		reader->buffers[i] = NULL;
+		reader->sizes[i] = 0;
+	}
+	reader->remaining = 0;
+}
+
+void reader_request(SST25_Reader *reader, uint8_t index)
+{
+	uint16_t size = reader->remaining > SST25_READ_CHUNK ? SST25_READ_CHUNK : reader->remaining;
+	reader->sizes[index] = size;
+	reader->ready[index] = 0;
+	while (SST25_read_async(reader->address, reader->buffers[index], size, reader_done, (void *) &reader->ready[index]))
+		;
+	reader->address += size;
+	reader->remaining -= size;
+}
+
+void reader_done(uint8_t error, void *context)
+{
+	*(volatile uint8_t *) context = 1; // Errors are counted in the stats, the chunk is returned as read
+}
+
+void blocking_done(uint8_t error, void *context)
+{
+	*(volatile uint8_t *) context = 1;
+}
+
+void SST25_get_stats(SST25_Stats *out)
+{
+	*out = stats;
+}
+
+void SST25_reset_stats()
+{
+	memset(&stats, 0, sizeof(SST25_Stats));
+}
+
+// kB/s over every read so far
+uint32_t SST25_read_rate()
+{
+	return stats.read_time ? (uint64_t) stats.bytes_read * 1000 / stats.read_time : 0;
+}
+
+uint32_t SST25_write_rate()
+{
+	return stats.write_time ? (uint64_t) stats.bytes_written * 1000 / stats.write_time : 0;
+}
+
+// Percent of page lookups served from RAM
+uint8_t SST25_cache_hit_rate()
+{
+	uint32_t lookups = stats.cache_hits + stats.cache_misses;
+	return lookups ? (uint64_t) stats.cache_hits * 100 / lookups : 0;
+}
+
+Cache_Page *cache_find(uint32_t page_address)
+{
+	for (uint8_t i = 0; i < SST25_CACHE_PAGES; i++)
+		if (cache[i].state != PAGE_EMPTY && cache[i].address == page_address)
+			return &cache[i];
+	return NULL;
+}
+
+// A page still being read ahead is waited for. A failed fill is still copied out but not kept
+Cache_Page *cache_lookup(uint32_t page_address)
+{
+	Cache_Page *page = cache_find(page_address);
+	if (page)
+		while (page->state == PAGE_FILLING)
+			;
+
+	if (page && page->state == PAGE_VALID)
+	{
+		stats.cache_hits++;
+		if (page->read_ahead)
+			stats.read_ahead_hits++;
+	}
+	else
+	{
+		stats.cache_misses++;
+		page = cache_victim();
+		page->address = page_address;
+		page->state = PAGE_FILLING;
+		wait_idle();
+		while (SST25_read_async(page_address, page->data, SST25_CACHE_PAGE_SIZE, page_filled, page))
+			;
+		while (page->state == PAGE_FILLING)
+			;
+	}
+	page->read_ahead = 0;
+	page->last_used = ++cache_tick;
+	return page;
+}
+
+// An empty page, otherwise the least recently used. Only one page fills at a time so there is always one
+Cache_Page *cache_victim()
+{
+	Cache_Page *victim = NULL;
+	for (uint8_t i = 0; i < SST25_CACHE_PAGES; i++)
+	{
+		if (cache[i].state == PAGE_EMPTY)
+			return &cache[i];
+		if (cache[i].state == PAGE_VALID && (!victim || cache[i].last_used < victim->last_used))
+			victim = &cache[i];
+	}
+	return victim;
+}
+
+// Only called with the bus idle or claimed, so no page is filling
+void cache_invalidate(uint32_t address, uint32_t size)
+{
+	for (uint8_t i = 0; i < SST25_CACHE_PAGES; i++)
+		if (cache[i].address < address + size && cache[i].address + SST25_CACHE_PAGE_SIZE > address)
+			cache[i].state = PAGE_EMPTY;
+}
+
+// Skipped if the page is already cached or the bus is taken, the reader never waits for a read-ahead it did not use
+void read_ahead(uint32_t page_address)
+{
+	if (cache_find(page_address) || SST25_busy())
+		return;
+
+	Cache_Page *page = cache_victim();
+	page->address = page_address;
+	page->read_ahead = 1;
+	page->last_used = ++cache_tick;
+	page->state = PAGE_FILLING;
+	if (SST25_read_async(page_address, page->data, SST25_CACHE_PAGE_SIZE, page_filled, page))
+		page->state = PAGE_EMPTY;
+	else
+		stats.read_aheads++;
+}
+
+void page_filled(uint8_t error, void *context)
+{
+	((Cache_Page *) context)->state = error ? PAGE_EMPTY : PAGE_VALID;
+}
+
+void wait_idle()
+{
+	while (step != STEP_IDLE)
+		;
+	while (SST25_erase_busy())
+		;
+}
+
+// Callbacks may start the next transfer, so taking the bus has to be atomic
+uint8_t claim(uint8_t first_step)
+{
+	if (SST25_erase_busy()) // No transfer runs during an erase, so the status read has the bus to itself
+		return 1;
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	uint8_t busy = step != STEP_IDLE;
+	if (!busy)
+		step = first_step;
+	__set_PRIMASK(primask);
+	return busy;
+}
+
+void transfer(uint8_t next_step, uint16_t tx_size, uint16_t rx_size)
+{
+	step = next_step;
+	SST25_start();
+	HAL_StatusTypeDef result;
+	if (rx_size)
+		result = HAL_SPI_TransmitReceive_DMA(&hspi3, control, control + 16, rx_size);
+	else
+		result = HAL_SPI_Transmit_DMA(&hspi3, control, tx_size);
+	if (result != HAL_OK)
+	{
+		SST25_end();
+		finish(1);
+	}
+}
+
+void send_command(uint8_t next_step, uint8_t command)
+{
+	control[0] = command;
+	transfer(next_step, 1, 0);
+}
+
+// The first word carries the address, later ones continue from it
+void prepare_aai_word()
+{
+	word_size = 0;
+	control[word_size++] = FLASH_AAI;
+	if (!op_written)
+	{
+		set_address(control + 1, op_address);
+		word_size += 3;
+	}
+	control[word_size++] = op_data[op_written++];
+	control[word_size++] = op_data[op_written++];
+}
+
+// Called once a word has been clocked out. The next one is ready to go before the wait starts
+void wait_ready()
+{
+	if (op_size - op_written > 1)
+		prepare_aai_word();
+	else
+		word_size = 0;
+
+	step = STEP_AAI_WAIT;
+	SST25_start();
+	EXTI->PR = FLASH_MISO_Pin; // Drop edges left over from the data phase
+	EXTI->RTSR |= FLASH_MISO_Pin;
+	EXTI->IMR |= FLASH_MISO_Pin;
+	if (HAL_GPIO_ReadPin(FLASH_MISO_GPIO_Port, FLASH_MISO_Pin)) // Already done, the edge came before the EXTI was armed
+		SST25_ready_interrupt();
+}
+
+void stop_waiting()
+{
+	EXTI->IMR &= ~FLASH_MISO_Pin;
+	EXTI->RTSR &= ~FLASH_MISO_Pin;
+}
+
+// From the EXTI on SO going high. Edges outside a wait are ignored
+void SST25_ready_interrupt()
+{
+	if (step != STEP_AAI_WAIT)
+		return;
+
+	stop_waiting();
+	SST25_end();
+	stats.ready_interrupts++;
+	if (word_size)
+		transfer(STEP_AAI_WORD, word_size, 0);
+	else
+		send_command(STEP_AAI_DISABLE, FLASH_WRITE_DISABLE);
+}
+
+void send_byte_program()
+{
+	control[0] = FLASH_BYTE_PROGRAM;
+	set_address(control + 1, op_address + op_written);
+	control[4] = op_data[op_written++];
+	transfer(STEP_BYTE_PROGRAM, 5, 0);
+}
+
+void poll(uint8_t next_step)
+{
+	control[0] = FLASH_READ_STATUS;
+	control[1] = 0x00;
+	transfer(next_step, 2, 2);
+}
+
+void advance()
+{
+	uint8_t busy = control[17] & FLASH_SBIT_BUSY;
+	switch (step)
+	{
+	case STEP_READ:
+		finish(0);
+		break;
+	case STEP_AAI_EBSY:
+		send_command(STEP_AAI_ENABLE, FLASH_WRITE_ENABLE);
+		break;
+	case STEP_AAI_ENABLE:
+		prepare_aai_word();
+		transfer(STEP_AAI_WORD, word_size, 0);
+		break;
+	case STEP_AAI_WORD:
+		wait_ready();
+		break;
+	case STEP_AAI_DISABLE:
+		send_command(STEP_AAI_DBSY, FLASH_DISABLE_SO);
+		break;
+	case STEP_AAI_DBSY:
+		if (op_written < op_size)
+			send_command(STEP_BYTE_ENABLE, FLASH_WRITE_ENABLE);
+		else
+			finish(0);
+		break;
+	case STEP_BYTE_ENABLE:
+		send_byte_program();
+		break;
+	case STEP_BYTE_PROGRAM:
+		poll(STEP_BYTE_POLL);
+		break;
+	case STEP_BYTE_POLL:
+		if (busy)
+			poll(STEP_BYTE_POLL);
+		else
+			finish(0);
+		break;
+	}
+}
+
+void finish(uint8_t error)
+{
+	uint32_t time = cycles_to_us(CPU_CYCLES - op_start);
+	if (step == STEP_READ)
+	{
+		if (!dma_pool_contains(op_buffer, op_size))
+			SCB_InvalidateDCache_by_Addr((void *) op_buffer, op_size);
+		stats.reads++;
+		stats.bytes_read += op_size;
+		stats.read_time += time;
+	}
+	else
+	{
+		stats.writes++;
+		stats.bytes_written += op_written;
+		stats.write_time += time;
+	}
+	if (error)
+		stats.errors++;
+
+	step = STEP_IDLE;
+	if (callback)
+		callback(error, callback_context);
+}
+
+void set_address(uint8_t *cmd, uint32_t address)
+{
+	cmd[0] = (address >> 16) & 0xFF;
+	cmd[1] = (address >> 8) & 0xFF;
+	cmd[2] = address & 0xFF;
+}
+
+uint32_t cycles_to_us(uint32_t cycles)
+{
+	return cycles / (SystemCoreClock / 1000000);
+}
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+	if (hspi != &hspi3)
+		return;
+	SST25_end();
+	advance();
+}
+
+void HAL_SPI_RxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+	if (hspi != &hspi3)
+		return;
+	SST25_end();
+	advance();
+}
+
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+	if (hspi != &hspi3)
+		return;
+	SST25_end();
+	advance();
+}
+
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi)
+{
+	if (hspi != &hspi3)
+		return;
+	SST25_end();
+	finish(1);
 }
 
 inline void SST25_start()
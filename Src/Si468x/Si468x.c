@@ -3,6 +3,8 @@
 #include "Si468x/Si468x.h"
 #include "Si468x/Si468x_minipatch.h"
 #include "Si468x/Si468x_DAB.h"
+#include "Si468x/Si468x_FM.h"
+#include "dma_pool.h"
 #include <stdlib.h>
 #include <string.h>
 
@@ -23,6 +25,8 @@
 #define PROP_INT_CTL_REPEAT					0x0001
 #define	PROP_DIGITAL_IO_OUTPUT_SELECT		0x0200
 #define PROP_DIGITAL_IO_OUTPUT_SAMPLE_RATE	0x0201
+#define PROP_AUDIO_ANALOG_VOLUME			0x0300
+#define PROP_AUDIO_MUTE						0x0301
 #define PROP_PIN_CONFIG_ENABLE				0x0800
 #define PROP_FLASH_SPI_CLOCK_FREQ_KHZ		0x0001
 #define PROP_HIGH_SPEED_READ_MAX_FREQ_MHZ	0x0103
@@ -31,67 +35,84 @@
 #define PROP_DAB_XPAD_ENABLE				0xB400
 #define PROP_DIGITAL_SERVICE_INT_SOURCE		0x8100
 
-static void si468x_power_up();
-static void si468x_load_init();
-static void si468x_load_minipatch();
-static void si468x_load_patch();
-static void si468x_load_ROM();
-static void si468x_boot();
-static void si468x_set_property(uint16_t property, uint16_t value);
-static void si468x_flash_set_property(uint16_t property, uint16_t value);
+static void si468x_power_up(Si468x_Device *device);
+static void si468x_load_init(Si468x_Device *device);
+static void si468x_load_minipatch(Si468x_Device *device);
+static void si468x_load_patch(Si468x_Device *device);
+static void si468x_load_ROM(Si468x_Device *device, enum Si468x_MODE mode);
+static void si468x_boot(Si468x_Device *device);
+static void si468x_main_reset(uint8_t assert);
+static void si468x_flash_set_property(Si468x_Device *device, uint16_t property, uint16_t value);
 
-static uint8_t patched = 0;
-static uint8_t update_interrupts = 0;
+Si468x_Device si468x_main = {Si4684_ADDRESS, I2C_write, I2C_write_read, si468x_main_reset};
+Si468x_Device *si468x_device = &si468x_main;
 
-void si468x_reset()
+void si468x_select(Si468x_Device *device)
 {
-	HAL_GPIO_WritePin(SI_RST_GPIO_Port, SI_RST_Pin, GPIO_PIN_RESET);
+	si468x_device = device;
 }
 
-void si468x_init(enum Si468x_MODE mode)
+void si468x_main_reset(uint8_t assert)
 {
-	current_mode = mode;
+	HAL_GPIO_WritePin(SI_RST_GPIO_Port, SI_RST_Pin, assert ? GPIO_PIN_RESET : GPIO_PIN_SET);
+}
+
+void si468x_reset(Si468x_Device *device)
+{
+	device->reset(1);
+}
 
-	si468x_reset();
+void si468x_init(Si468x_Device *device, enum Si468x_MODE mode)
+{
+	device->mode = mode;
+	// A re-init (FM <-> DAB) starts from the ROM again, so nothing from the last session may carry over
+	device->patched = 0;
+	device->async_pending = 0;
+	device->update_interrupts = 0;
+	device->interrupts.interrupt_register = 0;
+
+	si468x_reset(device);
 	HAL_Delay(10);
 
-	HAL_GPIO_WritePin(GPIOB, SI_RST_Pin, GPIO_PIN_SET);
+	device->reset(0);
 	HAL_Delay(10);
 
-	si468x_power_up();
+	si468x_power_up(device);
 	HAL_Delay(10);
 
-	si468x_load_init();
-	si468x_load_minipatch();
+	si468x_load_init(device);
+	si468x_load_minipatch(device);
 	HAL_Delay(10);
 
-	si468x_load_init();
-	si468x_load_patch();
+	si468x_load_init(device);
+	si468x_load_patch(device);
 	HAL_Delay(15);
 
-	si468x_flash_set_property(PROP_FLASH_SPI_CLOCK_FREQ_KHZ, 0x9C40); // Set flash speed to 40MHz
-	si468x_flash_set_property(PROP_HIGH_SPEED_READ_MAX_FREQ_MHZ, 0x00FF); // Set flash high speed read speed to 127MHz
+	si468x_flash_set_property(device, PROP_FLASH_SPI_CLOCK_FREQ_KHZ, 0x9C40); // Set flash speed to 40MHz
+	si468x_flash_set_property(device, PROP_HIGH_SPEED_READ_MAX_FREQ_MHZ, 0x00FF); // Set flash high speed read speed to 127MHz
 
-	si468x_load_init();
-	si468x_load_ROM(mode);
+	si468x_load_init(device);
+	si468x_load_ROM(device, mode);
 
-	si468x_boot();
+	si468x_boot(device);
 
-	si468x_set_property(PROP_INT_CTL_ENABLE, 0x00D1); // Enable CTS, ERR_CMD, STC and DSRV interrupts
-	si468x_set_property(PROP_INT_CTL_REPEAT, 0x0001); // Enable STC interrupt repeat
-	si468x_set_property(PROP_DIGITAL_IO_OUTPUT_SELECT, 0x8000); // I2S set master
-	si468x_set_property(PROP_DIGITAL_IO_OUTPUT_SAMPLE_RATE, 0xAC44); // I2S set sample rate 44.1kHz
-	si468x_set_property(PROP_PIN_CONFIG_ENABLE, 0x8002); // I2S enable
-	si468x_set_property(PROP_DAB_TUNE_FE_CFG, 0x0001); // VHFSW
-	si468x_set_property(PROP_FM_RDS_CONFIG, 0x0001); // Enable RDS processor
-	si468x_set_property(PROP_DAB_XPAD_ENABLE, 0x0003); // Enable full PAD and XPAD
-	si468x_set_property(PROP_DIGITAL_SERVICE_INT_SOURCE, 0x0001); // Enable DSRVPCKTINT
+	si468x_set_property(device, PROP_INT_CTL_ENABLE, 0x20D5); // Enable CTS, ERR_CMD, STC, RDS, DSRV and DEVNT interrupts
+	si468x_set_property(device, PROP_INT_CTL_REPEAT, 0x0001); // Enable STC interrupt repeat
+	si468x_set_property(device, PROP_DIGITAL_IO_OUTPUT_SELECT, 0x8000); // I2S set master
+	si468x_set_property(device, PROP_DIGITAL_IO_OUTPUT_SAMPLE_RATE, 0xAC44); // I2S set sample rate 44.1kHz
+	si468x_set_property(device, PROP_PIN_CONFIG_ENABLE, 0x8002); // I2S enable
+	si468x_set_property(device, PROP_DAB_TUNE_FE_CFG, 0x0001); // VHFSW
+	si468x_set_property(device, PROP_FM_RDS_CONFIG, 0xAA01); // Enable RDS processor, pass blocks with up to 5 corrected errors
+	si468x_set_property(device, PROP_DAB_XPAD_ENABLE, 0x0003); // Enable full PAD and XPAD
+	si468x_set_property(device, PROP_DIGITAL_SERVICE_INT_SOURCE, 0x0001); // Enable DSRVPCKTINT
 
 	if (mode == Si468x_MODE_DAB)
-		si468x_DAB_set_freq_list();
+		si468x_DAB_set_freq_list(device);
+	else if (mode == Si468x_MODE_FM)
+		si468x_FM_RDS_enable(device);
 }
 
-void si468x_power_up()
+void si468x_power_up(Si468x_Device *device)
 {
 	uint8_t args[] = {
 			0x80,	// CTSIEN
@@ -111,36 +132,36 @@ void si468x_power_up()
 			0x00
 	};
 	Si468x_Command *command = si468x_build_command(POWER_UP, args, 15);
-	si468x_execute(command);
+	si468x_execute(device, command);
 	si468x_free_command(command);
 }
 
-void si468x_load_init()
+void si468x_load_init(Si468x_Device *device)
 {
 	uint8_t args[] = {0x00};
 	Si468x_Command *command = si468x_build_command(LOAD_INIT, args, 1);
-	si468x_execute(command);
+	si468x_execute(device, command);
 	si468x_free_command(command);
 }
 
-void si468x_load_minipatch()
+void si468x_load_minipatch(Si468x_Device *device)
 {
 	uint8_t args[] = {0x00, 0x00, 0x00};
 	Si468x_Command *command = si468x_build_command_ext(HOST_LOAD, args, 3, minipatch_data, minipatch_size);
-	si468x_execute(command);
+	si468x_execute(device, command);
 	si468x_free_command(command);
 }
 
-void si468x_load_patch()
+void si468x_load_patch(Si468x_Device *device)
 {
 	uint8_t args[] = {0x00, 0x00, 0x00, 0x00, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
 	Si468x_Command *command = si468x_build_command(FLASH_LOAD, args, 11);
-	si468x_execute(command);
+	si468x_execute(device, command);
 	si468x_free_command(command);
-	patched = 1;
+	device->patched = 1;
 }
 
-void si468x_load_ROM(enum Si468x_MODE mode)
+void si468x_load_ROM(Si468x_Device *device, enum Si468x_MODE mode)
 {
 	uint8_t args[] = {
 			0x00,
@@ -156,84 +177,157 @@ void si468x_load_ROM(enum Si468x_MODE mode)
 			0x00
 	};
 	Si468x_Command *command = si468x_build_command(FLASH_LOAD, args, 11);
-	si468x_execute(command);
+	si468x_execute(device, command);
 	si468x_free_command(command);
 }
 
-void si468x_boot()
+void si468x_boot(Si468x_Device *device)
 {
 	uint8_t args[] = {0x00};
 	Si468x_Command *command = si468x_build_command(BOOT, args, 1);
-	si468x_execute(command);
+	si468x_execute(device, command);
 	si468x_free_command(command);
 }
 
-void si468x_set_property(uint16_t property, uint16_t value)
+void si468x_set_property(Si468x_Device *device, uint16_t property, uint16_t value)
 {
 	uint8_t args[] = {0x00, property & 0xFF, property >> 8, value & 0xFF, value >> 8};
 	Si468x_Command *command = si468x_build_command(SET_PROPERTY, args, 5);
-	si468x_execute(command);
+	si468x_execute(device, command);
 	si468x_free_command(command);
 }
 
-void si468x_flash_set_property(uint16_t property, uint16_t value)
+// 0-63
+void si468x_set_volume(Si468x_Device *device, uint8_t volume)
+{
+	if (volume > SI468X_MAX_VOLUME)
+		volume = SI468X_MAX_VOLUME;
+	si468x_set_property(device, PROP_AUDIO_ANALOG_VOLUME, volume);
+}
+
+void si468x_set_mute(Si468x_Device *device, uint8_t mute)
+{
+	si468x_set_property(device, PROP_AUDIO_MUTE, mute ? 0x0003 : 0x0000); // Both channels
+}
+
+void si468x_flash_set_property(Si468x_Device *device, uint16_t property, uint16_t value)
 {
 	uint8_t args[] = {0x10, 0x00, 0x00, property & 0xFF, property >> 8, value & 0xFF, value >> 8};
 	Si468x_Command *command = si468x_build_command(FLASH_SET_PROP_LIST, args, 7);
-	si468x_execute(command);
+	si468x_execute(device, command);
 	si468x_free_command(command);
 }
 
-void si468x_wait_for_interrupt(enum Interrupt interrupt)
+void si468x_wait_for_interrupt(Si468x_Device *device, enum Interrupt interrupt)
 {
 	uint8_t status = 0;
 	do
 	{
-		if (update_interrupts)
-			si468x_update_interrupts();
-		status = (Interrupt_Status.interrupt_register >> interrupt) & 0x01;
+		if (device->update_interrupts)
+			si468x_update_interrupts(device);
+		status = (device->interrupts.interrupt_register >> interrupt) & 0x01;
 		if (interrupt == CTS)
-			status |= (Interrupt_Status.interrupt_register >> ERR_CMD) & 0x01; //!!!
+			status |= (device->interrupts.interrupt_register >> ERR_CMD) & 0x01; //!!!
 	} while (!status);
 }
 
-void si468x_update_interrupts()
+void si468x_update_interrupts(Si468x_Device *device)
 {
-	uint8_t status_byte;
-	si468x_read_response(&status_byte, 1);
-	while (status_byte == 0x00)
-		si468x_read_response(&status_byte, 1); // !!!
-	Interrupt_Status.interrupt_register = status_byte;
-	update_interrupts = 0;
+	uint8_t status[2];
+	si468x_read_response(device, status, 2);
+	while (status[0] == 0x00)
+		si468x_read_response(device, status, 2); // !!!
+	device->interrupts.interrupt_register = status[0] | ((uint16_t) status[1] << 8);
+	device->update_interrupts = 0;
 }
 
-void si468x_interrupt()
+void si468x_interrupt(Si468x_Device *device)
 {
-	update_interrupts = 1;
+	device->update_interrupts = 1;
 }
 
-uint8_t si468x_execute(Si468x_Command *command)
+void si468x_service_interrupts(Si468x_Device *device)
 {
-	return si468x_execute_ext(command, patched);
+	// Only call between commands, the status read would otherwise consume a pending reply
+	if (device->update_interrupts)
+		si468x_update_interrupts(device);
 }
 
-uint8_t si468x_execute_ext(Si468x_Command *command, uint8_t use_interrupt)
+uint8_t si468x_execute(Si468x_Device *device, Si468x_Command *command)
 {
+	return si468x_execute_ext(device, command, device->patched);
+}
+
+uint8_t si468x_execute_ext(Si468x_Device *device, Si468x_Command *command, uint8_t use_interrupt)
+{
+	if (device->async_pending) // The chip only takes one command at a time, the async reply is dropped
+	{
+		si468x_wait_for_interrupt(device, CTS);
+		device->async_pending = 0;
+	}
+	if (!command)
+		return 1; // Out of memory when it was built
 	if (use_interrupt)
-		Interrupt_Status.CTS = 0;
-	I2C_write(Si4684_ADDRESS, command->data, command->size);
+		device->interrupts.CTS = 0;
+	device->write(device->address, command->data, command->size);
 	if (use_interrupt)
-		si468x_wait_for_interrupt(CTS);
+		si468x_wait_for_interrupt(device, CTS);
 	uint8_t read_buffer[4];
-	uint8_t error = si468x_read_response(read_buffer, 4);
+	uint8_t error = si468x_read_response(device, read_buffer, 4);
 	return error;
 }
 
-uint8_t si468x_read_response(uint8_t *response_buffer, uint16_t response_size)
+void si468x_execute_async(Si468x_Device *device, Si468x_Command *command)
+{
+	if (device->async_pending)
+		si468x_wait_for_interrupt(device, CTS);
+	if (!command)
+	{
+		device->async_pending = 0; // Nothing sent, the caller sees no reply coming and asks again
+		return;
+	}
+	device->interrupts.CTS = 0;
+	device->write(device->address, command->data, command->size);
+	device->async_pending = 1;
+}
+
+uint8_t si468x_async_pending(Si468x_Device *device)
+{
+	return device->async_pending;
+}
+
+// An interrupt has been raised but its status not read yet
+uint8_t si468x_interrupt_pending(Si468x_Device *device)
+{
+	return device->update_interrupts;
+}
+
+uint8_t si468x_async_ready(Si468x_Device *device)
+{
+	if (!device->async_pending)
+		return 0;
+
+	if (device->patched) // CTS raises an interrupt once the firmware is up
+	{
+		si468x_service_interrupts(device);
+		return device->interrupts.CTS || device->interrupts.ERR_CMD;
+	}
+
+	uint8_t status;
+	si468x_read_response(device, &status, 1);
+	return status & 0x80 ? 1 : 0;
+}
+
+uint8_t si468x_read_async_response(Si468x_Device *device, uint8_t *response_buffer, uint16_t response_size)
+{
+	device->async_pending = 0;
+	return si468x_read_response(device, response_buffer, response_size);
+}
+
+uint8_t si468x_read_response(Si468x_Device *device, uint8_t *response_buffer, uint16_t response_size)
 {
 	uint8_t command = RD_REPLY;
-	I2C_write(Si4684_ADDRESS, &command, 1);
-	I2C_read(Si4684_ADDRESS, response_buffer, response_size);
+	device->write_read(device->address, &command, 1, response_buffer, response_size);
 	return response_buffer[0] & 0x40 ? 1 : 0;
 }
 
@@ -245,8 +339,17 @@ Si468x_Command *si468x_build_command(uint8_t command_id, uint8_t *args, uint16_t
 Si468x_Command *si468x_build_command_ext(uint8_t command_id, uint8_t *args, uint16_t num_args, uint8_t *data, uint16_t data_size)
 {
 	Si468x_Command *command = (Si468x_Command *) malloc(sizeof(Si468x_Command));
+	if (!command)
+		return NULL;
 	command->size = 1 + num_args + data_size;
-	command->data = (uint8_t *) malloc(command->size);
+	command->data = (uint8_t *) dma_pool_alloc(command->size); // Sent by DMA straight from the pool
+	if (!command->data)
+		command->data = (uint8_t *) malloc(command->size); // Pool full, the I2C queue stages or cleans it instead
+	if (!command->data)
+	{
+		free(command);
+		return NULL;
+	}
 	command->data[0] = command_id;
 	memcpy(command->data + 1, args, num_args);
 	memcpy(command->data + 1 + num_args, data, data_size);
@@ -259,7 +362,10 @@ void si468x_free_command(Si468x_Command *command)
 		return;
 	if (command->data)
 	{
-		free(command->data);
+		if (dma_pool_contains(command->data, command->size))
+			dma_pool_free(command->data);
+		else
+			free(command->data);
 		command->data = NULL;
 	}
 	free(command);
@@ -2,31 +2,83 @@
 #include "Si468x/Si468x.h"
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <stm32f7xx_hal.h>
 #include "SST25V_flash.h"
 #include "stream_utils.h"
+#include "flash_map.h"
+#include "crc32.h"
+#include "dma_pool.h"
+#include "flash_kv.h"
 
 // DAB:
 #define DAB_TUNE_FREQ				0xB0
 #define DAB_DIGRAD_STATUS			0xB2
 #define DAB_GET_EVENT_STATUS		0xB3
+#define DAB_GET_ANNOUNCEMENT_INFO	0xB6
 #define DAB_SET_FREQ_LIST			0xB8
 #define DAB_GET_FREQ_LIST			0xB9
-#define DAB_GET_TIME				0xBC
 #define DAB_GET_COMPONENT_INFO		0xBB
 #define DAB_GET_TIME				0xBC
+#define DAB_GET_AUDIO_INFO			0xBD
+#define DAB_GET_SUBCHAN_INFO		0xBE
 
 #define GET_DIGITAL_SERVICE_LIST	0x80
 #define START_DIGITAL_SERVICE		0x81
+#define STOP_DIGITAL_SERVICE		0x82
 #define GET_DIGITAL_SERVICE_DATA	0x84
 
-static const uint32_t dab_freq_list[] = {
+// Properties:
+#define PROP_DAB_EVENT_INTERRUPT_SOURCE		0xB300
+#define PROP_DAB_ANNOUNCEMENT_ENABLE		0xB700
+
+#define NO_SERVICE					0xFFFF
+#define NO_FREQ_INDEX				0xFF
+#define MAX_ANNOUNCEMENTS_PER_EVENT	8
+
+#define SCAN_CACHE_MAGIC			0x43424144 // "DABC"
+#define SCAN_CACHE_VERSION			2 // Bump whenever the service record layout changes
+#define SCAN_CACHE_JOURNAL_OFFSET	16
+
+#define ANTCAP_AUTO					0
+#define ANTCAP_MAX					128 // 250 fF steps
+#define ANTCAP_COARSE_STEPS			8
+#define ANTCAP_FINE_STEP			8 // Halved once per refinement pass
+#define ANTCAP_FINE_PASSES			2 // Bounds the sweep to 1 + 8 + 2 * 2 tunes per channel
+
+#define SERVICE_STATS_RETRY			250 // ms, audio info reads zero until the decoder has locked
+#define SERVICE_STATS_COMPLETE		(STATS_AUDIO_INFO | STATS_SUBCHAN_INFO)
+
+static const Freq_kHz band_III_europe[] = {
 		174928, 176640, 178352, 180064, 181936, 183648, 185360, 187072, 188928, 190640,
 		192352, 194064, 195936, 197648, 199360, 201072, 202928, 204640, 206352, 208064,
 		209936, 211648, 213360, 215072, 216928, 218640, 220352, 222064, 223936, 225648,
-		227360, 229072, 230748, 232496, 234208, 235776, 237448, 239200
+		227360, 229072, 230784, 232496, 234208, 235776, 237488, 239200
+};
+
+static const Freq_kHz band_III_korea[] = {
+		175280, 177008, 178736, 181280, 183008, 184736, 187280, 189008, 190736, 193280,
+		195008, 196736, 199280, 201008, 202736, 205280, 207008, 208736, 211280, 213008,
+		214736
+};
+
+static const Freq_kHz band_III_australia[] = {
+		202928, 204640, 206352
 };
 
+typedef struct
+{
+	const Freq_kHz *frequencies;
+	uint8_t size;
+} DAB_Region_Table;
+
+static const DAB_Region_Table region_tables[] = {
+		[DAB_REGION_EUROPE]		= {band_III_europe, sizeof(band_III_europe) / sizeof(Freq_kHz)},
+		[DAB_REGION_KOREA]		= {band_III_korea, sizeof(band_III_korea) / sizeof(Freq_kHz)},
+		[DAB_REGION_AUSTRALIA]	= {band_III_australia, sizeof(band_III_australia) / sizeof(Freq_kHz)}
+};
+#define NUM_REGIONS (sizeof(region_tables) / sizeof(DAB_Region_Table))
+
 typedef struct
 {
 	uint32_t component_id;
@@ -40,6 +92,7 @@ typedef struct
 			uint8_t ty		: 6; // Audio/Data service component type
 		};
 	};
+	uint16_t user_applications; // DAB_User_Application flags, UA_UNKNOWN until fetched
 } DAB_Component;
 
 typedef struct
@@ -72,44 +125,191 @@ typedef struct
 	DAB_Service **services;
 } DAB_Service_List;
 
+typedef struct
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t num_services;
+	uint32_t freq_plan_hash;
+	uint32_t crc; // CRC-32 of the fields above
+} DAB_Scan_Cache_Header;
+
 void si468x_DAB_save_service_to_flash(DAB_Service *service, uint16_t memory_index);
+void si468x_DAB_save_user_applications(DAB_Service *service, uint16_t memory_index);
 //void si468x_load_service_name_list_from_flash(uint16_t memory_index);
 DAB_Service *si468x_load_service_from_flash(uint16_t memory_index);
 DAB_Service_List *si468x_DAB_decode_digital_service_list(uint8_t *service_list_data, uint8_t freq_index);
 DAB_Service_List *si468x_DAB_get_digital_service_list(uint8_t freq_index);
+void si468x_DAB_free_service(DAB_Service *service);
+static void si468x_DAB_play_component(DAB_Service *service, DAB_Component *component, uint16_t service_mem_id);
+static void si468x_DAB_stop_digital_service(uint32_t service_id, uint32_t component_id, enum Digital_Service_Type service_type);
+static DAB_Service *si468x_DAB_find_subchannel_service(uint8_t freq_index, uint8_t subchannel_id, DAB_Component **component, uint16_t *service_mem_id);
+static void si468x_DAB_handle_announcement(DAB_Announcement *announcement);
+void si468x_DAB_free_service_list(DAB_Service_List *service_list);
+static void si468x_DAB_load_region_plan(uint8_t region);
+static uint8_t si468x_DAB_load_freq_plan_from_flash();
+static void si468x_DAB_save_freq_plan_to_flash();
+static uint8_t si468x_DAB_scan_freq_plan(DAB_Service_List **ensembles);
+static void si468x_DAB_save_ensembles_to_flash(DAB_Service_List **ensembles, uint8_t size);
+
+static void si468x_DAB_write_scan_cache(uint16_t num_services);
+static void si468x_DAB_save_last_service(uint16_t service_mem_id);
 
-void si468x_DAB_set_freq_list()
+static uint16_t si468x_DAB_user_application_flag(uint16_t ua_type);
+static void si468x_DAB_tune_antcap(uint8_t freq_index, uint16_t antcap);
+static int16_t si468x_DAB_reception_score(uint8_t freq_index, uint16_t antcap);
+static void si468x_DAB_load_antcap_table();
+static void si468x_DAB_save_antcap_table();
+static uint8_t si468x_DAB_get_audio_info(DAB_Service_Stats *stats);
+static uint8_t si468x_DAB_get_subchan_info(uint32_t service_id, uint32_t component_id, DAB_Service_Stats *stats);
+
+static struct
+{
+	uint8_t pending;
+	Si468x_Device *device; // The reply is read back from the chip the request went to
+	uint16_t service_mem_id;
+	uint8_t component_index;
+	uint32_t service_id;
+	uint32_t component_id;
+} component_info_request;
+
+static DAB_Freq_Plan freq_plan;
+static uint8_t freq_plan_loaded = 0;
+
+static uint16_t antcap_table[DAB_MAX_FREQUENCIES]; // Per plan index, ANTCAP_AUTO when not calibrated
+static uint32_t antcap_plan_hash = 0;
+
+static uint16_t num_services = 0;
+static DAB_Service_Stats service_stats[FLASH_MAX_SERVICES]; // Per service_mem_id, cleared on every scan
+static uint32_t service_stats_last_attempt = 0;
+static uint16_t scan_cache_journal_offset = SCAN_CACHE_JOURNAL_OFFSET;
+
+static uint8_t tuned_freq_index = NO_FREQ_INDEX;
+static DAB_Service *current_service = NULL;
+static DAB_Component *current_component = NULL;
+static uint16_t current_service_mem_id = NO_SERVICE;
+
+static uint16_t announcement_types = 0;
+static uint8_t announcement_active = 0;
+static uint8_t announcement_cluster_id;
+static uint16_t announcement_return_service = NO_SERVICE;
+
+void si468x_DAB_set_freq_list(Si468x_Device *device)
 {
-	if (current_mode != Si468x_MODE_DAB)
+	if (device->mode != Si468x_MODE_DAB)
 		return;
 
-	uint8_t number_of_frequencies = sizeof(dab_freq_list) / sizeof(uint32_t);
-	uint16_t args_size = 4 + number_of_frequencies * 4;
+	if (!freq_plan_loaded)
+	{
+		if (!si468x_DAB_load_freq_plan_from_flash())
+			si468x_DAB_load_region_plan(DAB_REGION_EUROPE);
+		freq_plan_loaded = 1;
+	}
+
+	uint8_t number_of_frequencies = freq_plan.size;
+	uint16_t args_size = 3 + number_of_frequencies * 4;
 	uint8_t *args = (uint8_t *) malloc(args_size);
 	args[0] = number_of_frequencies;
 	args[1] = 0x00;
 	args[2] = 0x00;
 	for (int i = 0; i < number_of_frequencies; i++)
 	{
-		args[3 + 4 * i] = dab_freq_list[i] & 0xFF;
-		args[4 + 4 * i] = (dab_freq_list[i] >> 8) & 0xFF;
-		args[5 + 4 * i] = (dab_freq_list[i] >> 16) & 0xFF;
-		args[6 + 4 * i] = dab_freq_list[i] >> 24;
+		args[3 + 4 * i] = freq_plan.frequencies[i] & 0xFF;
+		args[4 + 4 * i] = (freq_plan.frequencies[i] >> 8) & 0xFF;
+		args[5 + 4 * i] = (freq_plan.frequencies[i] >> 16) & 0xFF;
+		args[6 + 4 * i] = freq_plan.frequencies[i] >> 24;
 	}
 	Si468x_Command *command = si468x_build_command(DAB_SET_FREQ_LIST, args, args_size);
-	si468x_execute(command);
+	si468x_execute(device, command);
 	si468x_free_command(command);
 	free(args);
+
+	tuned_freq_index = NO_FREQ_INDEX; // Indices refer to the new list from here on
+	if (antcap_plan_hash != si468x_DAB_freq_plan_hash())
+		si468x_DAB_load_antcap_table();
 }
 
-void si468x_DAB_band_scan()
+void si468x_DAB_set_region(enum DAB_Region region)
+{
+	Si468x_Device *device = si468x_device;
+	if (region >= NUM_REGIONS)
+		return;
+
+	si468x_DAB_load_region_plan(region);
+	freq_plan_loaded = 1;
+	si468x_DAB_save_freq_plan_to_flash();
+	si468x_DAB_set_freq_list(device);
+}
+
+const DAB_Freq_Plan *si468x_DAB_get_freq_plan()
+{
+	return &freq_plan;
+}
+
+uint32_t si468x_DAB_freq_plan_hash()
+{
+	uint8_t header[] = {freq_plan.region, freq_plan.learned, freq_plan.size};
+	uint32_t crc = crc32_update(CRC32_INIT, header, 3);
+	crc = crc32_update(crc, (uint8_t *) freq_plan.frequencies, freq_plan.size * sizeof(Freq_kHz));
+	return crc ^ CRC32_INIT;
+}
+
+void si468x_DAB_load_region_plan(uint8_t region)
+{
+	freq_plan.region = region;
+	freq_plan.learned = 0;
+	freq_plan.size = region_tables[region].size;
+	memcpy(freq_plan.frequencies, region_tables[region].frequencies, freq_plan.size * sizeof(Freq_kHz));
+}
+
+uint8_t si468x_DAB_load_freq_plan_from_flash()
+{
+	uint16_t stream_size = flash_kv_size(FLASH_KEY_FREQ_PLAN);
+	if (stream_size < 5 || stream_size > 5 + DAB_MAX_FREQUENCIES * 4) // Never saved or corrupt
+		return 0;
+
+	uint8_t *data = malloc(stream_size);
+	flash_kv_read(FLASH_KEY_FREQ_PLAN, data, stream_size);
+	Stream *stream = stream_load(data, stream_size);
+
+	uint8_t valid = 0;
+	uint8_t region = stream_read_uint8(stream);
+	uint8_t learned = stream_read_uint8(stream);
+	uint8_t size = stream_read_uint8(stream);
+	if (region < NUM_REGIONS && size && size <= DAB_MAX_FREQUENCIES && stream_size == 5 + size * 4)
+	{
+		freq_plan.region = region;
+		freq_plan.learned = learned;
+		freq_plan.size = size;
+		for (uint8_t i = 0; i < size; i++)
+			freq_plan.frequencies[i] = stream_read_uint32(stream);
+		valid = 1;
+	}
+	stream_free(stream);
+	return valid;
+}
+
+void si468x_DAB_save_freq_plan_to_flash()
+{
+	Stream *stream = stream_create();
+	stream_write_uint8(stream, freq_plan.region);
+	stream_write_uint8(stream, freq_plan.learned);
+	stream_write_uint8(stream, freq_plan.size);
+	for (uint8_t i = 0; i < freq_plan.size; i++)
+		stream_write_uint32(stream, freq_plan.frequencies[i]);
+	stream_flush(stream);
+	flash_kv_write(FLASH_KEY_FREQ_PLAN, stream->data, stream->data_size);
+	stream_free(stream);
+}
+
+uint8_t si468x_DAB_scan_freq_plan(DAB_Service_List **ensembles)
 {
 	DAB_DigRad_Status digrad_status;
 	DAB_Event_Status event_status;
-	volatile uint16_t service_mem_id = 0;
-	uint16_t total_services = 0;
-	for (int freq_index = 0; freq_index < sizeof(dab_freq_list) / sizeof(uint32_t); freq_index++)
+	uint8_t num_ensembles = 0;
+	for (int freq_index = 0; freq_index < freq_plan.size; freq_index++)
 	{
+		ensembles[freq_index] = NULL;
 		si468x_DAB_tune(freq_index);
 		si468x_DAB_get_digrad_status(&digrad_status);
 
@@ -120,94 +320,386 @@ void si468x_DAB_band_scan()
 				si468x_DAB_get_event_status(&event_status);
 
 			HAL_Delay(500);
-			DAB_Service_List *service_list = si468x_DAB_get_digital_service_list(freq_index);
-			total_services += service_list->size;
-			for (uint8_t service_index = 0; service_index < service_list->size; service_index++)
-				service_mem_id++;//si468x_DAB_save_service_to_flash(service_list->services[service_index], service_mem_id++);
+			ensembles[freq_index] = si468x_DAB_get_digital_service_list(freq_index);
+			if (ensembles[freq_index])
+				num_ensembles++;
 		}
 	}
-	SST25_sector_erase_4K(4096);
-	SST25_write(4096, (uint8_t *) &total_services, 2);
-	//!!! Handle memory freeing
+	return num_ensembles;
+}
+
+void si468x_DAB_save_ensembles_to_flash(DAB_Service_List **ensembles, uint8_t size)
+{
+	SST25_sector_erase_4K(FLASH_SCAN_CACHE_ADDRESS); // Invalidate until every service is written
+
+	memset(service_stats, 0, sizeof(service_stats));
+	for (uint16_t memory_index = 0; memory_index < FLASH_MAX_SERVICES; memory_index++)
+		flash_kv_delete(FLASH_KEY_USER_APPLICATIONS + memory_index); // Fetched for the old service list
+
+	uint16_t service_mem_id = 0;
+	for (uint8_t freq_index = 0; freq_index < size; freq_index++)
+	{
+		if (!ensembles[freq_index])
+			continue;
+		for (uint8_t service_index = 0; service_index < ensembles[freq_index]->size && service_mem_id < FLASH_MAX_SERVICES; service_index++)
+			si468x_DAB_save_service_to_flash(ensembles[freq_index]->services[service_index], service_mem_id++);
+		si468x_DAB_free_service_list(ensembles[freq_index]);
+	}
+	si468x_DAB_write_scan_cache(service_mem_id);
+}
+
+uint8_t si468x_DAB_load_scan_cache(uint16_t *last_service_mem_id)
+{
+	DAB_Scan_Cache_Header header;
+	SST25_read(FLASH_SCAN_CACHE_ADDRESS, (uint8_t *) &header, sizeof(DAB_Scan_Cache_Header));
+	if (header.magic != SCAN_CACHE_MAGIC || header.version != SCAN_CACHE_VERSION
+			|| header.crc != crc32((uint8_t *) &header, offsetof(DAB_Scan_Cache_Header, crc))
+			|| header.freq_plan_hash != si468x_DAB_freq_plan_hash()
+			|| header.num_services > FLASH_MAX_SERVICES)
+		return 0;
+
+	num_services = header.num_services;
+
+	// The journal holds one entry per service change, the last written one wins. The next chunk is read by DMA while one is scanned
+	*last_service_mem_id = 0;
+	SST25_Reader reader;
+	scan_cache_journal_offset = SCAN_CACHE_JOURNAL_OFFSET;
+	if (!SST25_reader_open(&reader, FLASH_SCAN_CACHE_ADDRESS + SCAN_CACHE_JOURNAL_OFFSET, FLASH_SECTOR_SIZE - SCAN_CACHE_JOURNAL_OFFSET))
+	{
+		const uint16_t *journal;
+		uint16_t chunk_size;
+		while ((journal = (const uint16_t *) SST25_reader_next(&reader, &chunk_size)))
+		{
+			uint16_t entry;
+			for (entry = 0; entry < chunk_size / 2 && journal[entry] != 0xFFFF; entry++)
+				*last_service_mem_id = journal[entry];
+			scan_cache_journal_offset += 2 * entry;
+			if (entry < chunk_size / 2)
+				break;
+		}
+		SST25_reader_close(&reader);
+	}
+	if (*last_service_mem_id >= num_services)
+		*last_service_mem_id = 0;
+	return num_services ? 1 : 0;
+}
+
+uint16_t si468x_DAB_get_num_services()
+{
+	return num_services;
+}
+
+uint16_t si468x_DAB_get_current_service()
+{
+	return current_service_mem_id;
+}
+
+// 0 for an empty slot
+uint32_t si468x_DAB_get_service_id(uint16_t service_mem_id)
+{
+	if (service_mem_id >= num_services)
+		return 0;
+
+	DAB_Service *service = si468x_load_service_from_flash(service_mem_id);
+	uint32_t service_id = service->service_id;
+	si468x_DAB_free_service(service);
+	return service_id;
+}
+
+void si468x_DAB_write_scan_cache(uint16_t service_count)
+{
+	DAB_Scan_Cache_Header header;
+	header.magic = SCAN_CACHE_MAGIC;
+	header.version = SCAN_CACHE_VERSION;
+	header.num_services = service_count;
+	header.freq_plan_hash = si468x_DAB_freq_plan_hash();
+	header.crc = crc32((uint8_t *) &header, offsetof(DAB_Scan_Cache_Header, crc));
+
+	SST25_sector_erase_4K(FLASH_SCAN_CACHE_ADDRESS);
+	SST25_write(FLASH_SCAN_CACHE_ADDRESS, (uint8_t *) &header, sizeof(DAB_Scan_Cache_Header));
+	num_services = service_count;
+	scan_cache_journal_offset = SCAN_CACHE_JOURNAL_OFFSET;
+}
+
+void si468x_DAB_save_last_service(uint16_t service_mem_id)
+{
+	if (!num_services)
+		return;
+
+	if (scan_cache_journal_offset >= FLASH_SECTOR_SIZE) // Journal full, start over with a fresh sector
+		si468x_DAB_write_scan_cache(num_services);
+	SST25_write(FLASH_SCAN_CACHE_ADDRESS + scan_cache_journal_offset, (uint8_t *) &service_mem_id, 2);
+	scan_cache_journal_offset += 2;
+}
+
+void si468x_DAB_band_scan()
+{
+	Si468x_Device *device = si468x_device;
+	// A full scan always walks the whole region plan, then keeps only the channels that carried ensembles
+	si468x_DAB_load_region_plan(freq_plan.region);
+	freq_plan_loaded = 1;
+	si468x_DAB_set_freq_list(device);
+
+	DAB_Service_List *ensembles[DAB_MAX_FREQUENCIES];
+	if (si468x_DAB_scan_freq_plan(ensembles))
+	{
+		uint8_t learned_size = 0;
+		for (uint8_t freq_index = 0; freq_index < freq_plan.size; freq_index++)
+		{
+			if (!ensembles[freq_index])
+				continue;
+			for (uint8_t service_index = 0; service_index < ensembles[freq_index]->size; service_index++)
+				ensembles[freq_index]->services[service_index]->freq_index = learned_size;
+			freq_plan.frequencies[learned_size] = freq_plan.frequencies[freq_index];
+			ensembles[learned_size++] = ensembles[freq_index];
+		}
+		freq_plan.size = learned_size;
+		freq_plan.learned = 1;
+		si468x_DAB_set_freq_list(device);
+	}
+	si468x_DAB_save_freq_plan_to_flash();
+	si468x_DAB_save_ensembles_to_flash(ensembles, freq_plan.size);
+}
+
+uint8_t si468x_DAB_quick_scan()
+{
+	if (!freq_plan.learned)
+	{
+		si468x_DAB_band_scan();
+		return freq_plan.learned ? freq_plan.size : 0;
+	}
+
+	DAB_Service_List *ensembles[DAB_MAX_FREQUENCIES];
+	uint8_t num_ensembles = si468x_DAB_scan_freq_plan(ensembles);
+	si468x_DAB_save_ensembles_to_flash(ensembles, freq_plan.size);
+	return num_ensembles;
 }
 
 void si468x_DAB_tune_service(uint16_t service_mem_id)
 {
 	DAB_Service *service = si468x_load_service_from_flash(service_mem_id);
-	si468x_DAB_tune(service->freq_index);
-	si468x_DAB_start_digital_service(service->service_id, service->components[0]->component_id, SER_AUDIO);
+	announcement_active = 0; // A manual service change cancels any pending return from an announcement
+	si468x_DAB_play_component(service, service->components[0], service_mem_id);
+	si468x_DAB_save_last_service(service_mem_id);
+}
+
+void si468x_DAB_play_component(DAB_Service *service, DAB_Component *component, uint16_t service_mem_id)
+{
+	if (service->freq_index != tuned_freq_index)
+		si468x_DAB_tune(service->freq_index);
+	else if (current_service) // Same ensemble: swap services without retuning
+		si468x_DAB_stop_digital_service(current_service->service_id, current_component->component_id, SER_AUDIO);
+
+	si468x_DAB_start_digital_service(service->service_id, component->component_id, SER_AUDIO);
+
+	si468x_DAB_free_service(current_service);
+	current_service = service;
+	current_component = component;
+	current_service_mem_id = service_mem_id;
+	service_stats_last_attempt = HAL_GetTick();
 }
 
 void si468x_DAB_tune(uint8_t freq_index)
 {
-	if (current_mode != Si468x_MODE_DAB)
+	si468x_DAB_tune_antcap(freq_index, freq_index < DAB_MAX_FREQUENCIES ? antcap_table[freq_index] : ANTCAP_AUTO);
+}
+
+void si468x_DAB_tune_antcap(uint8_t freq_index, uint16_t antcap)
+{
+	Si468x_Device *device = si468x_device;
+	if (device->mode != Si468x_MODE_DAB)
 		return;
 
-	uint8_t args[] = {0x00, freq_index, 0x00, 0x00, 0x00};
+	uint8_t args[] = {0x00, freq_index, 0x00, antcap & 0xFF, antcap >> 8};
 	Si468x_Command *command = si468x_build_command(DAB_TUNE_FREQ, args, 5);
-	Interrupt_Status.STCINT = 0;
-	si468x_execute(command);
+	device->interrupts.STCINT = 0;
+	si468x_execute(device, command);
 	si468x_free_command(command);
-	si468x_wait_for_interrupt(STCINT);
+	si468x_wait_for_interrupt(device, STCINT);
+
+	// Tuning stops any running service
+	si468x_DAB_free_service(current_service);
+	current_service = NULL;
+	current_component = NULL;
+	current_service_mem_id = NO_SERVICE;
+	tuned_freq_index = freq_index;
+}
+
+uint8_t si468x_DAB_calibrate_antcap()
+{
+	uint8_t calibrated = 0;
+	for (uint8_t freq_index = 0; freq_index < freq_plan.size; freq_index++)
+	{
+		antcap_table[freq_index] = ANTCAP_AUTO;
+		int16_t best_score = si468x_DAB_reception_score(freq_index, ANTCAP_AUTO);
+		if (best_score == INT16_MIN)
+			continue; // Nothing to calibrate against
+
+		// Coarse sweep over the whole range, then refine around the best point
+		uint16_t best_antcap = ANTCAP_AUTO;
+		for (uint8_t step = 0; step < ANTCAP_COARSE_STEPS; step++)
+		{
+			uint16_t antcap = ANTCAP_MAX / ANTCAP_COARSE_STEPS * step + ANTCAP_MAX / ANTCAP_COARSE_STEPS / 2;
+			int16_t score = si468x_DAB_reception_score(freq_index, antcap);
+			if (score > best_score)
+			{
+				best_score = score;
+				best_antcap = antcap;
+			}
+		}
+		if (best_antcap == ANTCAP_AUTO)
+			continue;
+
+		uint16_t fine_step = ANTCAP_FINE_STEP;
+		for (uint8_t pass = 0; pass < ANTCAP_FINE_PASSES; pass++, fine_step /= 2)
+		{
+			uint16_t centre = best_antcap;
+			uint16_t candidates[] = {centre - fine_step, centre + fine_step};
+			for (uint8_t i = 0; i < 2; i++)
+			{
+				if (candidates[i] < 1 || candidates[i] > ANTCAP_MAX)
+					continue;
+				int16_t score = si468x_DAB_reception_score(freq_index, candidates[i]);
+				if (score > best_score)
+				{
+					best_score = score;
+					best_antcap = candidates[i];
+				}
+			}
+		}
+		antcap_table[freq_index] = best_antcap;
+		calibrated++;
+	}
+	si468x_DAB_save_antcap_table();
+	return calibrated;
+}
+
+int16_t si468x_DAB_reception_score(uint8_t freq_index, uint16_t antcap)
+{
+	DAB_DigRad_Status digrad_status;
+	si468x_DAB_tune_antcap(freq_index, antcap);
+	si468x_DAB_get_digrad_status(&digrad_status);
+	if (!digrad_status.ACQ)
+		return INT16_MIN;
+	return (digrad_status.VALID ? 1024 : 0) + 4 * digrad_status.snr + digrad_status.rssi;
+}
+
+void si468x_DAB_load_antcap_table()
+{
+	memset(antcap_table, 0, sizeof(antcap_table));
+	antcap_plan_hash = si468x_DAB_freq_plan_hash();
+
+	uint16_t stream_size = flash_kv_size(FLASH_KEY_ANTCAP);
+	if (stream_size < 7 || stream_size > 7 + DAB_MAX_FREQUENCIES * 2)
+		return;
+
+	uint8_t *data = malloc(stream_size);
+	flash_kv_read(FLASH_KEY_ANTCAP, data, stream_size);
+	Stream *stream = stream_load(data, stream_size);
+	uint32_t plan_hash = stream_read_uint32(stream);
+	uint8_t size = stream_read_uint8(stream);
+	if (plan_hash == antcap_plan_hash && size == freq_plan.size && stream_size == 7 + size * 2) // Indices only hold for the plan it was calibrated on
+		for (uint8_t i = 0; i < size; i++)
+			antcap_table[i] = stream_read_uint16(stream);
+	stream_free(stream);
+}
+
+void si468x_DAB_save_antcap_table()
+{
+	antcap_plan_hash = si468x_DAB_freq_plan_hash();
+
+	Stream *stream = stream_create();
+	stream_write_uint32(stream, antcap_plan_hash);
+	stream_write_uint8(stream, freq_plan.size);
+	for (uint8_t i = 0; i < freq_plan.size; i++)
+		stream_write_uint16(stream, antcap_table[i]);
+	stream_flush(stream);
+	flash_kv_write(FLASH_KEY_ANTCAP, stream->data, stream->data_size);
+	stream_free(stream);
 }
 
 void si468x_DAB_get_digrad_status(DAB_DigRad_Status *status)
 {
-	if (current_mode != Si468x_MODE_DAB)
+	Si468x_Device *device = si468x_device;
+	if (device->mode != Si468x_MODE_DAB)
 		return;
 
 	uint8_t args[] = {0x00};
 	Si468x_Command *command = si468x_build_command(DAB_DIGRAD_STATUS, args, 1);
-	si468x_execute(command);
+	si468x_execute(device, command);
 	si468x_free_command(command);
 
 	uint8_t read_buffer[23];
-	si468x_read_response(read_buffer, 23);
+	si468x_read_response(device, read_buffer, 23);
 	memcpy(status->data, read_buffer + 4, 19);
 }
 
 void si468x_DAB_get_event_status(DAB_Event_Status *status)
 {
-	if (current_mode != Si468x_MODE_DAB)
+	Si468x_Device *device = si468x_device;
+	if (device->mode != Si468x_MODE_DAB)
 		return;
 
-	uint8_t args[] = {0x00};
+	uint8_t args[] = {0x01}; // EVENT_ACK
 	Si468x_Command *command = si468x_build_command(DAB_GET_EVENT_STATUS, args, 1);
-	si468x_execute(command);
+	si468x_execute(device, command);
 	si468x_free_command(command);
 
 	uint8_t read_buffer[8];
-	si468x_read_response(read_buffer, 8);
+	si468x_read_response(device, read_buffer, 8);
 	memcpy(status->data, read_buffer + 4, 4);
 }
 
 DAB_Service_List *si468x_DAB_get_digital_service_list(uint8_t freq_index)
 {
-	if (current_mode != Si468x_MODE_DAB)
+	Si468x_Device *device = si468x_device;
+	if (device->mode != Si468x_MODE_DAB)
 		return NULL;
 
 	uint8_t args[] = {0x00};
 	Si468x_Command *command = si468x_build_command(GET_DIGITAL_SERVICE_LIST, args, 1);
-	si468x_execute(command);
+	si468x_execute(device, command);
 	si468x_free_command(command);
 
 	uint8_t read_buffer[8];
-	si468x_read_response(read_buffer, 6);
+	si468x_read_response(device, read_buffer, 6);
 	uint16_t service_list_size = read_buffer[4] + (((uint16_t) read_buffer[5]) << 8);
 
-	uint8_t *service_list_data = (uint8_t *) malloc(service_list_size + 4);
+	uint8_t *service_list_data = (uint8_t *) dma_pool_alloc(service_list_size + 4);
 	if (!service_list_data)
 		return NULL; // !!! ERROR
-	si468x_read_response(service_list_data, service_list_size + 4);
+	si468x_read_response(device, service_list_data, service_list_size + 4);
 	DAB_Service_List *service_list = si468x_DAB_decode_digital_service_list(service_list_data + 4, freq_index);
-	free(service_list_data);
+	dma_pool_free(service_list_data);
 
 	return service_list;
 	//!!!
 }
 
-void si468x_DAB_get_component_info(uint32_t service_id, uint32_t component_id)
+uint8_t si468x_DAB_request_component_info(uint16_t service_mem_id, uint8_t component_index)
 {
+	Si468x_Device *device = si468x_device;
+	if (device->mode != Si468x_MODE_DAB || service_mem_id >= num_services)
+		return 0;
+
+	DAB_Service *service = service_mem_id == current_service_mem_id ? current_service : si468x_load_service_from_flash(service_mem_id);
+	uint8_t cached = component_index >= service->num_comp || service->components[component_index]->user_applications != UA_UNKNOWN;
+	if (!cached)
+	{
+		component_info_request.pending = 1;
+		component_info_request.device = device;
+		component_info_request.service_mem_id = service_mem_id;
+		component_info_request.component_index = component_index;
+		component_info_request.service_id = service->service_id;
+		component_info_request.component_id = service->components[component_index]->component_id;
+	}
+	if (service != current_service)
+		si468x_DAB_free_service(service);
+	if (cached)
+		return 1;
+
+	uint32_t service_id = component_info_request.service_id;
+	uint32_t component_id = component_info_request.component_id;
 	uint8_t args[] = {
 			0x00,
 			0x00,
@@ -221,22 +713,95 @@ void si468x_DAB_get_component_info(uint32_t service_id, uint32_t component_id)
 			(component_id >> 16) & 0xFF,
 			component_id >> 24
 	};
-	Si468x_Command *command = si468x_build_command(DAB_GET_COMPONENT_INFO, args, 1);
-	si468x_execute(command);
+	Si468x_Command *command = si468x_build_command(DAB_GET_COMPONENT_INFO, args, 11);
+	si468x_execute_async(device, command);
 	si468x_free_command(command);
+	return 0;
+}
+
+uint8_t si468x_DAB_poll_component_info()
+{
+	if (!component_info_request.pending)
+		return 0;
+
+	Si468x_Device *device = component_info_request.device;
+	if (!si468x_async_pending(device)) // Another command took the reply, ask again
+	{
+		component_info_request.pending = 0;
+		si468x_DAB_request_component_info(component_info_request.service_mem_id, component_info_request.component_index);
+		return 0;
+	}
+	if (!si468x_async_ready(device))
+		return 0;
+
+	uint8_t header[28];
+	if (si468x_read_async_response(device, header, 28))
+	{
+		component_info_request.pending = 0; // ERR_CMD, the component is not in the current ensemble
+		return 0;
+	}
+	uint8_t num_user_applications = header[26];
+	uint16_t response_size = 28 + header[27];
+	uint8_t *response_buffer = (uint8_t *) dma_pool_alloc(response_size);
+	if (!response_buffer)
+		return 0; // Requested again on the next poll
+	si468x_read_response(device, response_buffer, response_size);
+
+	// Each entry: UATYPE (11 bits in 2 bytes), UADATALEN, UADATA
+	uint16_t user_applications = 0;
+	uint16_t data_pointer = 28;
+	for (uint8_t i = 0; i < num_user_applications && data_pointer + 3 <= response_size; i++)
+	{
+		uint16_t ua_type = (response_buffer[data_pointer] + (((uint16_t) response_buffer[data_pointer + 1]) << 8)) & 0x07FF;
+		user_applications |= si468x_DAB_user_application_flag(ua_type);
+		data_pointer += 3 + response_buffer[data_pointer + 2];
+	}
+	dma_pool_free(response_buffer);
+	component_info_request.pending = 0;
+
+	uint16_t service_mem_id = component_info_request.service_mem_id;
+	DAB_Service *service = service_mem_id == current_service_mem_id ? current_service : si468x_load_service_from_flash(service_mem_id);
+	DAB_Component *component = service->components[component_info_request.component_index];
+	if (component->user_applications != user_applications)
+	{
+		component->user_applications = user_applications;
+		si468x_DAB_save_user_applications(service, service_mem_id);
+	}
+	if (service != current_service)
+		si468x_DAB_free_service(service);
+	return 1;
+}
 
-	HAL_Delay(5000);
+uint16_t si468x_DAB_get_user_applications(uint16_t service_mem_id, uint8_t component_index)
+{
+	if (service_mem_id >= num_services)
+		return UA_UNKNOWN;
+
+	if (service_mem_id == current_service_mem_id)
+		return component_index < current_service->num_comp ? current_service->components[component_index]->user_applications : UA_UNKNOWN;
 
-	uint8_t response_buffer[50];
-	si468x_read_response(response_buffer, 50);
-	uint8_t num_user_applications = response_buffer[26];
-	//if (num_user_applications)
-		HAL_Delay(1);
-	// !!!
+	DAB_Service *service = si468x_load_service_from_flash(service_mem_id);
+	uint16_t user_applications = component_index < service->num_comp ? service->components[component_index]->user_applications : UA_UNKNOWN;
+	si468x_DAB_free_service(service);
+	return user_applications;
+}
+
+uint16_t si468x_DAB_user_application_flag(uint16_t ua_type)
+{
+	switch (ua_type) // ETSI TS 101 756 table 16
+	{
+	case 0x002: return UA_SLIDESHOW;
+	case 0x003: return UA_BWS;
+	case 0x004: return UA_TPEG;
+	case 0x007: return UA_EPG;
+	case 0x44A: return UA_JOURNALINE;
+	default: return UA_OTHER;
+	}
 }
 
 void si468x_DAB_start_digital_service(uint32_t service_id, uint32_t component_id, enum Digital_Service_Type service_type)
 {
+	Si468x_Device *device = si468x_device;
 	uint8_t args[] = {
 			service_type,
 			0x00,
@@ -251,18 +816,40 @@ void si468x_DAB_start_digital_service(uint32_t service_id, uint32_t component_id
 			component_id >> 24
 	};
 	Si468x_Command *command = si468x_build_command(START_DIGITAL_SERVICE, args, 11);
-	si468x_execute(command);
+	si468x_execute(device, command);
+	si468x_free_command(command);
+}
+
+void si468x_DAB_stop_digital_service(uint32_t service_id, uint32_t component_id, enum Digital_Service_Type service_type)
+{
+	Si468x_Device *device = si468x_device;
+	uint8_t args[] = {
+			service_type,
+			0x00,
+			0x00,
+			service_id & 0xFF,
+			(service_id >> 8) & 0xFF,
+			(service_id >> 16) & 0xFF,
+			service_id >> 24,
+			component_id & 0xFF,
+			(component_id >> 8) & 0xFF,
+			(component_id >> 16) & 0xFF,
+			component_id >> 24
+	};
+	Si468x_Command *command = si468x_build_command(STOP_DIGITAL_SERVICE, args, 11);
+	si468x_execute(device, command);
 	si468x_free_command(command);
 }
 
 void si468x_DAB_get_digital_service_data(uint8_t *buffer, uint16_t *size, uint8_t only_status)
 {
+	Si468x_Device *device = si468x_device;
 	uint8_t args[] = {0x01 | (only_status ? 0x10 : 0x00)};
 	Si468x_Command *command = si468x_build_command(GET_DIGITAL_SERVICE_DATA, args, 1);
-	si468x_execute(command);
+	si468x_execute(device, command);
 	si468x_free_command(command);
 
-	si468x_read_response(buffer, 20);
+	si468x_read_response(device, buffer, 20);
 
 	uint16_t byte_count = (buffer[19] << 8) + buffer[18];
 	if (!byte_count)
@@ -272,28 +859,230 @@ void si468x_DAB_get_digital_service_data(uint8_t *buffer, uint16_t *size, uint8_
 	if (data_source != 0x02)
 		return;
 
-	si468x_read_response(buffer, 24 + byte_count);
+	si468x_read_response(device, buffer, 24 + byte_count);
 	HAL_Delay(1);
 }
 
-DAB_Time si468x_DAB_get_time()
+DAB_Time si468x_DAB_get_time(uint8_t utc)
 {
-	uint8_t args[] = {0x00};
+	Si468x_Device *device = si468x_device;
+	uint8_t args[] = {utc ? 0x01 : 0x00}; // TIME_TYPE: 0 local, 1 UTC
 	Si468x_Command *command = si468x_build_command(DAB_GET_TIME, args, 1);
-	si468x_execute(command);
+	si468x_execute(device, command);
 	si468x_free_command(command);
 
 	DAB_Time time;
-	si468x_read_response(time.data, 11);
-
-	HAL_Delay(1);
+	si468x_read_response(device, time.data, 11);
 
 	return time;
 }
 
+void si468x_DAB_enable_announcements(uint16_t types)
+{
+	Si468x_Device *device = si468x_device;
+	if (device->mode != Si468x_MODE_DAB)
+		return;
+
+	announcement_types = types;
+	si468x_set_property(device, PROP_DAB_ANNOUNCEMENT_ENABLE, types);
+	si468x_set_property(device, PROP_DAB_EVENT_INTERRUPT_SOURCE, types ? 0x0089 : 0x0081); // SRVLIST and RECFG, plus ANNO when subscribed
+}
+
+uint8_t si468x_DAB_get_announcement_info(DAB_Announcement *announcement)
+{
+	Si468x_Device *device = si468x_device;
+	uint8_t args[] = {0x00};
+	Si468x_Command *command = si468x_build_command(DAB_GET_ANNOUNCEMENT_INFO, args, 1);
+	si468x_execute(device, command);
+	si468x_free_command(command);
+
+	uint8_t read_buffer[16];
+	si468x_read_response(device, read_buffer, 16);
+	announcement->queue_size = read_buffer[4] & 0x1F;
+	announcement->cluster_id = read_buffer[5];
+	announcement->source = read_buffer[6] >> 6;
+	announcement->started = read_buffer[6] & 0x01;
+	announcement->asw = read_buffer[8] + (((uint16_t) read_buffer[9]) << 8);
+	announcement->id1 = read_buffer[10] + (((uint16_t) read_buffer[11]) << 8);
+	announcement->id2 = read_buffer[12] + (((uint16_t) read_buffer[13]) << 8);
+
+	return announcement->queue_size ? 1 : 0;
+}
+
+void si468x_DAB_process_events()
+{
+	if (si468x_device->mode != Si468x_MODE_DAB)
+		return;
+
+	DAB_Event_Status event_status;
+	si468x_DAB_get_event_status(&event_status);
+	if (event_status.RECFGINT && current_service_mem_id != NO_SERVICE)
+		service_stats[current_service_mem_id].valid = 0; // Subchannel layout or bitrate may have changed
+	if (!event_status.ANNOINT)
+		return;
+
+	DAB_Announcement announcement;
+	for (uint8_t i = 0; i < MAX_ANNOUNCEMENTS_PER_EVENT && si468x_DAB_get_announcement_info(&announcement); i++)
+		si468x_DAB_handle_announcement(&announcement);
+}
+
+uint8_t si468x_DAB_update_service_stats()
+{
+	if (si468x_device->mode != Si468x_MODE_DAB || current_service_mem_id >= FLASH_MAX_SERVICES)
+		return 0;
+
+	DAB_Service_Stats *stats = &service_stats[current_service_mem_id];
+	if (stats->valid == SERVICE_STATS_COMPLETE)
+		return 1;
+	if (HAL_GetTick() - service_stats_last_attempt < SERVICE_STATS_RETRY)
+		return 0;
+	service_stats_last_attempt = HAL_GetTick();
+
+	if (!(stats->valid & STATS_SUBCHAN_INFO) && si468x_DAB_get_subchan_info(current_service->service_id, current_component->component_id, stats))
+		stats->valid |= STATS_SUBCHAN_INFO;
+	if (!(stats->valid & STATS_AUDIO_INFO) && si468x_DAB_get_audio_info(stats))
+		stats->valid |= STATS_AUDIO_INFO;
+
+	return stats->valid == SERVICE_STATS_COMPLETE;
+}
+
+uint8_t si468x_DAB_get_service_stats(uint16_t service_mem_id, DAB_Service_Stats *stats)
+{
+	if (service_mem_id >= FLASH_MAX_SERVICES)
+		return 0;
+
+	*stats = service_stats[service_mem_id];
+	return stats->valid;
+}
+
+// Decoded PCM rate, for sizing resampler and streaming budgets
+uint32_t si468x_DAB_get_pcm_bit_rate(uint16_t service_mem_id)
+{
+	if (service_mem_id >= FLASH_MAX_SERVICES || !(service_stats[service_mem_id].valid & STATS_AUDIO_INFO))
+		return 0;
+
+	uint8_t channels = service_stats[service_mem_id].audio_mode == AUDIO_MONO ? 1 : 2;
+	return (uint32_t) service_stats[service_mem_id].sample_rate * channels * 16;
+}
+
+uint8_t si468x_DAB_get_audio_info(DAB_Service_Stats *stats)
+{
+	Si468x_Device *device = si468x_device;
+	uint8_t args[] = {0x00};
+	Si468x_Command *command = si468x_build_command(DAB_GET_AUDIO_INFO, args, 1);
+	si468x_execute(device, command);
+	si468x_free_command(command);
+
+	uint8_t read_buffer[10];
+	if (si468x_read_response(device, read_buffer, 10))
+		return 0;
+
+	stats->audio_bit_rate = read_buffer[4] + (((uint16_t) read_buffer[5]) << 8);
+	stats->sample_rate = read_buffer[6] + (((uint16_t) read_buffer[7]) << 8);
+	stats->ps = (read_buffer[8] >> 3) & 0x01;
+	stats->sbr = (read_buffer[8] >> 2) & 0x01;
+	stats->audio_mode = read_buffer[8] & 0x03;
+	stats->drc_gain = read_buffer[9];
+
+	return stats->audio_bit_rate && stats->sample_rate;
+}
+
+uint8_t si468x_DAB_get_subchan_info(uint32_t service_id, uint32_t component_id, DAB_Service_Stats *stats)
+{
+	Si468x_Device *device = si468x_device;
+	uint8_t args[] = {
+			0x00,
+			0x00,
+			0x00,
+			service_id & 0xFF,
+			(service_id >> 8) & 0xFF,
+			(service_id >> 16) & 0xFF,
+			service_id >> 24,
+			component_id & 0xFF,
+			(component_id >> 8) & 0xFF,
+			(component_id >> 16) & 0xFF,
+			component_id >> 24
+	};
+	Si468x_Command *command = si468x_build_command(DAB_GET_SUBCHAN_INFO, args, 11);
+	si468x_execute(device, command);
+	si468x_free_command(command);
+
+	uint8_t read_buffer[12];
+	if (si468x_read_response(device, read_buffer, 12))
+		return 0;
+
+	stats->service_mode = read_buffer[4];
+	stats->protection_info = read_buffer[5];
+	stats->subchan_bit_rate = read_buffer[6] + (((uint16_t) read_buffer[7]) << 8);
+	stats->num_cu = read_buffer[8] + (((uint16_t) read_buffer[9]) << 8);
+	stats->cu_address = read_buffer[10] + (((uint16_t) read_buffer[11]) << 8);
+
+	return 1;
+}
+
+void si468x_DAB_handle_announcement(DAB_Announcement *announcement)
+{
+	if (announcement->source != 0)
+		return; // Announcements on other ensembles would need a full tune
+
+	if (announcement->started)
+	{
+		if (announcement_active || !(announcement->asw & announcement_types) || tuned_freq_index == NO_FREQ_INDEX)
+			return;
+
+		DAB_Component *component;
+		uint16_t service_mem_id;
+		DAB_Service *service = si468x_DAB_find_subchannel_service(tuned_freq_index, announcement->id2 & 0x3F, &component, &service_mem_id);
+		if (!service)
+			return;
+		if (service_mem_id == current_service_mem_id)
+		{
+			si468x_DAB_free_service(service);
+			return;
+		}
+
+		announcement_return_service = current_service_mem_id;
+		announcement_cluster_id = announcement->cluster_id;
+		announcement_active = 1;
+		si468x_DAB_play_component(service, component, service_mem_id);
+	}
+	else if (announcement_active && announcement->cluster_id == announcement_cluster_id)
+	{
+		announcement_active = 0;
+		if (announcement_return_service == NO_SERVICE)
+			return;
+
+		DAB_Service *service = si468x_load_service_from_flash(announcement_return_service);
+		si468x_DAB_play_component(service, service->components[0], announcement_return_service);
+	}
+}
+
+DAB_Service *si468x_DAB_find_subchannel_service(uint8_t freq_index, uint8_t subchannel_id, DAB_Component **component, uint16_t *service_mem_id)
+{
+	for (uint16_t memory_index = 0; memory_index < num_services; memory_index++)
+	{
+		DAB_Service *service = si468x_load_service_from_flash(memory_index);
+		if (service->freq_index == freq_index)
+		{
+			for (uint8_t component_index = 0; component_index < service->num_comp; component_index++)
+			{
+				// Stream audio components (TMId 0) carry the SubChId in the low 6 bits
+				if ((service->components[component_index]->component_id & 0x3F) == subchannel_id)
+				{
+					*component = service->components[component_index];
+					*service_mem_id = memory_index;
+					return service;
+				}
+			}
+		}
+		si468x_DAB_free_service(service);
+	}
+	return NULL;
+}
+
 DAB_Service_List *si468x_DAB_decode_digital_service_list(uint8_t *service_list_data, uint8_t freq_index)
 {
-	if (current_mode != Si468x_MODE_DAB)
+	if (si468x_device->mode != Si468x_MODE_DAB)
 		return NULL;
 
 	DAB_Service_List *service_list = malloc(sizeof(DAB_Service_List));
@@ -343,6 +1132,7 @@ DAB_Service_List *si468x_DAB_decode_digital_service_list(uint8_t *service_list_d
 			DAB_Component *component = (DAB_Component*) malloc(sizeof(DAB_Component));
 			component->component_id = component_id;
 			component->component_info = service_list_data[data_pointer];
+			component->user_applications = UA_UNKNOWN;
 
 			service->components[j] = component;
 		}
@@ -354,7 +1144,7 @@ DAB_Service_List *si468x_DAB_decode_digital_service_list(uint8_t *service_list_d
 void si468x_DAB_save_service_to_flash(DAB_Service *service, uint16_t memory_index)
 {
 	Stream *stream = stream_create();
-	uint32_t memory_address = 4096 * (memory_index + 2); // Keep first 8192 bytes free for control data
+	uint32_t memory_address = FLASH_SERVICES_ADDRESS + FLASH_SECTOR_SIZE * memory_index;
 	SST25_sector_erase_4K(memory_address);
 	stream_write_uint8(stream, service->freq_index);
 	stream_write_uint32(stream, service->service_id);
@@ -366,6 +1156,7 @@ void si468x_DAB_save_service_to_flash(DAB_Service *service, uint16_t memory_inde
 		DAB_Component *component = service->components[component_index];
 		stream_write_uint32(stream, component->component_id);
 		stream_write_uint8(stream, component->component_info);
+		stream_write_uint16(stream, component->user_applications);
 	}
 	stream_flush(stream);
 	SST25_write(memory_address, stream->data, stream->data_size);
@@ -375,9 +1166,10 @@ void si468x_DAB_save_service_to_flash(DAB_Service *service, uint16_t memory_inde
 DAB_Service *si468x_load_service_from_flash(uint16_t memory_index)
 {
 	uint16_t stream_size;
-	SST25_read(4096 * (memory_index + 2), (uint8_t *) &stream_size, 2);
+	uint32_t memory_address = FLASH_SERVICES_ADDRESS + FLASH_SECTOR_SIZE * memory_index;
+	SST25_read(memory_address, (uint8_t *) &stream_size, 2);
 	uint8_t *data = malloc(stream_size);
-	SST25_read(4096 * (memory_index + 2), data, stream_size);
+	SST25_read(memory_address, data, stream_size);
 	Stream *stream = stream_load(data, stream_size);
 
 	DAB_Service *service = malloc(sizeof(DAB_Service));
@@ -392,8 +1184,48 @@ DAB_Service *si468x_load_service_from_flash(uint16_t memory_index)
 		DAB_Component *component = malloc(sizeof(DAB_Component));
 		component->component_id = stream_read_uint32(stream);
 		component->component_info = stream_read_uint8(stream);
+		component->user_applications = stream_read_uint16(stream);
 		service->components[component_index] = component;
 	}
 	stream_free(stream);
+
+	// Fetched after the scan, kept apart so the service sector is never rewritten
+	uint16_t user_applications[15];
+	if (flash_kv_size(FLASH_KEY_USER_APPLICATIONS + memory_index) == service->num_comp * 2)
+	{
+		flash_kv_read(FLASH_KEY_USER_APPLICATIONS + memory_index, user_applications, service->num_comp * 2);
+		for (uint8_t component_index = 0; component_index < service->num_comp; component_index++)
+			service->components[component_index]->user_applications = user_applications[component_index];
+	}
 	return service;
 }
+
+void si468x_DAB_save_user_applications(DAB_Service *service, uint16_t memory_index)
+{
+	uint16_t user_applications[15];
+	for (uint8_t component_index = 0; component_index < service->num_comp; component_index++)
+		user_applications[component_index] = service->components[component_index]->user_applications;
+	flash_kv_write(FLASH_KEY_USER_APPLICATIONS + memory_index, user_applications, service->num_comp * 2);
+}
+
+void si468x_DAB_free_service(DAB_Service *service)
+{
+	if (!service)
+		return;
+
+	for (uint8_t component_index = 0; component_index < service->num_comp; component_index++)
+		free(service->components[component_index]);
+	free(service->components);
+	free(service);
+}
+
+void si468x_DAB_free_service_list(DAB_Service_List *service_list)
+{
+	if (!service_list)
+		return;
+
+	for (uint8_t service_index = 0; service_index < service_list->size; service_index++)
+		si468x_DAB_free_service(service_list->services[service_index]);
+	free(service_list->services);
+	free(service_list);
+}
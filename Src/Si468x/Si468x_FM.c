@@ -1,6 +1,10 @@
 #include "Si468x/Si468x.h"
 #include "Si468x/Si468x_FM.h"
+#include "rds.h"
+#include "FM_stations.h"
+#include <stm32f7xx_hal.h>
 #include <stdlib.h>
+#include <string.h>
 
 // FM:
 #define FM_TUNE_FREQ				0x30
@@ -9,25 +13,120 @@
 #define FM_RDS_STATUS				0x34
 #define FM_RDS_BLOCKCOUNT			0x35
 
-void si468x_FM_tune(float MHz)
+// FM_RDS_STATUS RESP5
+#define FM_RDS_PIVALID				0x08
+#define FM_RDS_FIFOLOST				0x01
+
+#define PROP_FM_RDS_INTERRUPT_SOURCE		0x3C00
+#define PROP_FM_RDS_INTERRUPT_FIFO_COUNT	0x3C01
+
+#define PROP_FM_SEEK_BAND_BOTTOM			0x1100
+#define PROP_FM_SEEK_BAND_TOP				0x1101
+#define PROP_FM_SEEK_FREQUENCY_SPACING		0x1102
+
+#define FM_SCAN_PI_TIMEOUT			250 // ms, about three RDS groups
+#define FM_SCAN_PI_POLL				20
+
+#define RDS_FIFO_SIZE				25
+#define RDS_FIFO_THRESHOLD			8 // Groups per RDSINT, about 0.7 s of RDS
+
+#define FM_TUNE_MODE_NORMAL			0
+#define FM_TUNE_MODE_AF_TUNE		2 // Accelerated, skips validation
+#define FM_TUNE_MODE_AF_CHECK		3 // Accelerated, audio stays muted until the next tune
+
+#define AF_SAMPLE_INTERVAL			250 // ms between RSQ samples of the tuned frequency
+#define AF_HISTORY					8 // Samples averaged before the tuned frequency is judged weak
+#define AF_CHECK_INTERVAL			2000 // ms between AF checks, each costs one short mute
+#define AF_WEAK_SCORE				40 // Mean FM_stations_score below which AFs are checked
+#define AF_SWITCH_MARGIN			10 // An AF must beat the tuned frequency's mean by this much
+#define AF_MIN_CHECKS				3 // Checks averaged before an AF can win
+#define AF_PI_TIMEOUT				300 // ms to confirm the PI after switching
+#define AF_BLOCK_TIME				60000 // ms an AF is ignored after carrying a different PI
+
+static void si468x_FM_tune_mode(Freq_kHz freq, uint8_t tune_mode);
+static void si468x_FM_AF_reset();
+static void si468x_FM_AF_check(const RDS_Data *rds, int16_t tuned_score);
+static uint8_t si468x_FM_AF_switch(uint8_t candidate, uint16_t pi);
+static int16_t si468x_FM_rsq_score(const FM_RSQ_Status *status);
+
+static enum Freq_Band fm_band = BAND_FM_EUROPE;
+static Freq_kHz tuned_freq = 0;
+
+static uint8_t af_enabled = 0;
+static int16_t af_history[AF_HISTORY]; // Scores of the tuned frequency
+static uint8_t af_history_size;
+static uint8_t af_history_index;
+static uint32_t af_last_sample;
+static uint32_t af_last_check;
+static uint8_t af_next_candidate;
+static struct
+{
+	Freq_kHz freq;
+	int16_t score; // Running mean of the checks, x4
+	uint8_t checks;
+	uint32_t blocked_until;
+} af_candidates[RDS_MAX_AF];
+static FM_AF_Stats af_stats;
+
+void si468x_FM_set_band(enum Freq_Band band)
+{
+	fm_band = band;
+}
+
+void si468x_FM_tune(Freq_kHz freq)
 {
-	if (current_mode != Si468x_MODE_FM)
+	if (si468x_device->mode != Si468x_MODE_FM)
 		return;
 
-	uint16_t freq = MHz * 100;
-	uint8_t args[] = {0x00, freq & 0xFF, freq >> 8, 0x00, 0x00};
+	si468x_FM_tune_mode(freq, FM_TUNE_MODE_NORMAL);
+	rds_reset();
+	si468x_FM_AF_reset();
+}
+
+void si468x_FM_tune_mode(Freq_kHz freq, uint8_t tune_mode)
+{
+	Si468x_Device *device = si468x_device;
+	uint16_t freq_10khz = freq / 10;
+	uint8_t args[] = {tune_mode << 2, freq_10khz & 0xFF, freq_10khz >> 8, 0x00, 0x00};
 	Si468x_Command *command = si468x_build_command(FM_TUNE_FREQ, args, 5);
-	Interrupt_Status.STCINT = 0;
-	si468x_execute(command);
-	si468x_wait_for_interrupt(STCINT);
+	device->interrupts.STCINT = 0;
+	si468x_execute(device, command);
+	si468x_wait_for_interrupt(device, STCINT);
 	si468x_free_command(command);
+
+	if (tune_mode != FM_TUNE_MODE_AF_CHECK)
+		tuned_freq = freq;
 }
 
-float si468x_FM_seek(uint8_t up, uint8_t wrap)
+void si468x_FM_RDS_enable(Si468x_Device *device)
 {
-	if (current_mode != Si468x_MODE_FM)
+	if (device->mode != Si468x_MODE_FM)
+		return;
+
+	si468x_set_property(device, PROP_FM_RDS_INTERRUPT_FIFO_COUNT, RDS_FIFO_THRESHOLD);
+	si468x_set_property(device, PROP_FM_RDS_INTERRUPT_SOURCE, 0x0001); // RDSRECV
+	rds_reset();
+}
+
+Freq_kHz si468x_FM_seek(uint8_t up, uint8_t wrap)
+{
+	if (si468x_device->mode != Si468x_MODE_FM)
 		return 0;
 
+	si468x_FM_seek_start(up, wrap);
+
+	FM_RSQ_Status status;
+	si468x_FM_get_rsq_status(&status);
+	tuned_freq = status.freq;
+
+	rds_reset();
+	si468x_FM_AF_reset();
+	return status.freq;
+}
+
+void si468x_FM_seek_start(uint8_t up, uint8_t wrap)
+{
+	Si468x_Device *device = si468x_device;
 	uint8_t args[] = {
 			0x10,
 			((up & 0x1) << 1) | (wrap & 0x1),
@@ -36,52 +135,269 @@ float si468x_FM_seek(uint8_t up, uint8_t wrap)
 			0x00
 	};
 	Si468x_Command *command = si468x_build_command(FM_SEEK_START, args, 5);
-	Interrupt_Status.STCINT = 0;
-	si468x_execute(command);
-	free(command);
-	si468x_wait_for_interrupt(STCINT);
-
-	args[0] = 0x00;
-	command = si468x_build_command(FM_RSQ_STATUS, args, 1);
-	si468x_execute(command);
+	device->interrupts.STCINT = 0;
+	si468x_execute(device, command);
+	si468x_free_command(command);
+	si468x_wait_for_interrupt(device, STCINT);
+}
+
+void si468x_FM_get_rsq_status(FM_RSQ_Status *status)
+{
+	Si468x_Device *device = si468x_device;
+	uint8_t args[] = {0x01}; // Clear STCINT
+	Si468x_Command *command = si468x_build_command(FM_RSQ_STATUS, args, 1);
+	si468x_execute(device, command);
+	si468x_free_command(command);
+
 	uint8_t read_buffer[22];
-	si468x_read_response(read_buffer, 22);
-	uint16_t new_freq = read_buffer[6] + (((uint16_t) read_buffer[7]) << 8);
+	si468x_read_response(device, read_buffer, 22);
+	status->valid = read_buffer[5] & 0x01;
+	status->band_limit = read_buffer[5] >> 7;
+	status->freq = (read_buffer[6] + (((uint16_t) read_buffer[7]) << 8)) * 10;
+	status->freq_offset = read_buffer[8];
+	status->rssi = read_buffer[9];
+	status->snr = read_buffer[10];
+	status->multipath = read_buffer[11];
+}
+
+// Scans the selected band with the chip's own seek, which validates each channel faster than tune-and-measure
+uint8_t si468x_FM_band_scan(FM_Station_List *list)
+{
+	Si468x_Device *device = si468x_device;
+	FM_stations_clear(list);
+	if (device->mode != Si468x_MODE_FM)
+		return 0;
+
+	uint32_t start = HAL_GetTick();
+	const Freq_Raster *raster = &freq_rasters[fm_band];
+	si468x_set_property(device, PROP_FM_SEEK_BAND_BOTTOM, raster->bottom / 10);
+	si468x_set_property(device, PROP_FM_SEEK_BAND_TOP, raster->top / 10);
+	si468x_set_property(device, PROP_FM_SEEK_FREQUENCY_SPACING, raster->spacing / 10);
+
+	FM_RSQ_Status status;
+	si468x_FM_tune(raster->bottom); // Seek starts from the next channel, so check the band edge first
+	si468x_FM_get_rsq_status(&status);
+	Freq_kHz last_freq = 0;
+	while (status.freq > last_freq)
+	{
+		last_freq = status.freq;
+		if (status.valid)
+		{
+			FM_Station station;
+			station.freq = status.freq;
+			station.rssi = status.rssi;
+			station.snr = status.snr;
+			station.multipath = status.multipath;
+			station.pi = si468x_FM_wait_for_pi(FM_SCAN_PI_TIMEOUT);
+			FM_stations_add(list, &station);
+		}
+		if (status.band_limit || status.freq >= raster->top)
+			break;
+
+		si468x_FM_seek_start(1, 0);
+		si468x_FM_get_rsq_status(&status);
+	}
+
+	FM_stations_rank(list);
+	list->scan_time = HAL_GetTick() - start;
+	FM_stations_save(list);
+	tuned_freq = status.freq;
+	rds_reset();
+	si468x_FM_AF_reset();
+	return list->size;
+}
+
+// The chip flags PI as soon as one clean block A is seen, well before the decoder's confidence is met
+uint16_t si468x_FM_wait_for_pi(uint16_t timeout)
+{
+	Si468x_Device *device = si468x_device;
+	uint32_t start = HAL_GetTick();
+	uint8_t args[] = {0x04}; // STATUSONLY, leaves the FIFO alone
+	Si468x_Command *command = si468x_build_command(FM_RDS_STATUS, args, 1);
+	uint8_t rds_data[10];
+	uint16_t pi = FM_NO_PI;
+	do
+	{
+		si468x_execute(device, command);
+		si468x_read_response(device, rds_data, 10);
+		if (rds_data[5] & FM_RDS_PIVALID)
+		{
+			pi = rds_data[8] + (((uint16_t) rds_data[9]) << 8);
+			break;
+		}
+		HAL_Delay(FM_SCAN_PI_POLL);
+	} while (HAL_GetTick() - start < timeout);
 	si468x_free_command(command);
-	return (float) new_freq / 100;
+	return pi;
 }
 
-unsigned char station_name[8];
-void si468x_FM_RDS_status()
+// Drains the RDS FIFO in one batch once RDSINT reports it has filled to the threshold
+uint8_t si468x_FM_RDS_service()
 {
-	uint8_t args[] = {0x01};
+	Si468x_Device *device = si468x_device;
+	if (device->mode != Si468x_MODE_FM)
+		return 0;
+
+	uint8_t args[] = {0x05}; // STATUSONLY, INTACK
 	Si468x_Command *command = si468x_build_command(FM_RDS_STATUS, args, 1);
-	si468x_execute(command);
+	si468x_execute(device, command);
 	si468x_free_command(command);
 
 	uint8_t rds_data[20];
-	si468x_read_response(rds_data, 20);
-
-	uint16_t BLOCK_A = ((uint16_t) rds_data[13] << 8) + rds_data[12];
-	uint16_t BLOCK_B = ((uint16_t) rds_data[15] << 8) + rds_data[14];
-	uint16_t BLOCK_C = ((uint16_t) rds_data[17] << 8) + rds_data[16];
-	uint16_t BLOCK_D = ((uint16_t) rds_data[19] << 8) + rds_data[18];
-	uint8_t group_type = (BLOCK_B & 0xF800) >> 8; //!!!
-	uint8_t C10 = BLOCK_B & 0x03;
-	if (group_type == 0)
+	si468x_read_response(device, rds_data, 20);
+	device->interrupts.RDSINT = 0;
+	if (rds_data[5] & FM_RDS_FIFOLOST)
+		rds_group_lost(1); // The exact count is not reported
+
+	uint8_t fifo_used = rds_data[10];
+	if (fifo_used > RDS_FIFO_SIZE)
+		fifo_used = RDS_FIFO_SIZE;
+
+	args[0] = 0x00; // Pop one group per read
+	command = si468x_build_command(FM_RDS_STATUS, args, 1);
+	for (uint8_t i = 0; i < fifo_used; i++)
 	{
-		uint8_t decoder_identification_code = 3 - C10;
-		station_name[6 - 2 * decoder_identification_code] = BLOCK_D >> 8;
-		station_name[6 - 2 * decoder_identification_code + 1] = BLOCK_D & 0xFF;
+		si468x_execute(device, command);
+		si468x_read_response(device, rds_data, 20);
+
+		uint16_t blocks[4];
+		uint8_t block_errors[4];
+		for (uint8_t block = 0; block < 4; block++)
+		{
+			blocks[block] = ((uint16_t) rds_data[13 + 2 * block] << 8) + rds_data[12 + 2 * block];
+			block_errors[block] = (rds_data[11] >> (6 - 2 * block)) & 0x03;
+		}
+		rds_decode_group(blocks, block_errors);
 	}
-	else if (group_type == 4)
+	si468x_free_command(command);
+
+	rds_publish();
+	return fifo_used;
+}
+
+void si468x_FM_AF_enable(uint8_t enable)
+{
+	af_enabled = enable;
+	si468x_FM_AF_reset();
+}
+
+void si468x_FM_AF_reset()
+{
+	af_history_size = 0;
+	af_history_index = 0;
+	af_next_candidate = 0;
+	af_last_check = HAL_GetTick();
+	memset(af_candidates, 0, sizeof(af_candidates));
+}
+
+// Samples the tuned frequency and, once its recent mean is weak, checks one AF per interval
+void si468x_FM_AF_task()
+{
+	if (si468x_device->mode != Si468x_MODE_FM || !af_enabled)
+		return;
+
+	uint32_t tick = HAL_GetTick();
+	if (tick - af_last_sample < AF_SAMPLE_INTERVAL)
+		return;
+	af_last_sample = tick;
+
+	FM_RSQ_Status status;
+	si468x_FM_get_rsq_status(&status);
+	af_history[af_history_index] = si468x_FM_rsq_score(&status);
+	af_history_index = (af_history_index + 1) % AF_HISTORY;
+	if (af_history_size < AF_HISTORY)
+		af_history_size++;
+	if (af_history_size < AF_HISTORY)
+		return;
+
+	int16_t tuned_score = 0;
+	for (uint8_t i = 0; i < AF_HISTORY; i++)
+		tuned_score += af_history[i];
+	tuned_score /= AF_HISTORY;
+	if (tuned_score >= AF_WEAK_SCORE || tick - af_last_check < AF_CHECK_INTERVAL)
+		return;
+
+	RDS_Data rds;
+	if ((rds_get_snapshot(&rds) & (RDS_VALID_PI | RDS_VALID_AF)) != (RDS_VALID_PI | RDS_VALID_AF))
+		return;
+
+	af_last_check = tick;
+	si468x_FM_AF_check(&rds, tuned_score);
+}
+
+void si468x_FM_AF_check(const RDS_Data *rds, int16_t tuned_score)
+{
+	// Round robin over the list, one check per call keeps each mute to a single AF
+	uint8_t candidate = RDS_MAX_AF;
+	uint32_t tick = HAL_GetTick();
+	for (uint8_t i = 0; i < rds->num_af; i++)
 	{
-		uint32_t date_and_time;
-		date_and_time = (BLOCK_B & 0x03) << 16;
-		date_and_time += BLOCK_C << 8;
-		date_and_time += BLOCK_D;
+		uint8_t index = (af_next_candidate + i) % rds->num_af;
+		if (af_candidates[index].freq != rds->af[index])
+		{
+			af_candidates[index].freq = rds->af[index];
+			af_candidates[index].score = 0;
+			af_candidates[index].checks = 0;
+			af_candidates[index].blocked_until = tick;
+		}
+		if (rds->af[index] == tuned_freq || (int32_t) (tick - af_candidates[index].blocked_until) < 0)
+			continue;
+		candidate = index;
+		break;
+	}
+	if (candidate == RDS_MAX_AF)
+		return;
+	af_next_candidate = candidate + 1;
+
+	uint32_t start = HAL_GetTick();
+	FM_RSQ_Status status;
+	si468x_FM_tune_mode(af_candidates[candidate].freq, FM_TUNE_MODE_AF_CHECK);
+	si468x_FM_get_rsq_status(&status);
+	si468x_FM_tune_mode(tuned_freq, FM_TUNE_MODE_AF_TUNE);
+	uint16_t gap = HAL_GetTick() - start;
+
+	af_stats.checks++;
+	af_stats.last_check_time = gap;
+	if (gap > af_stats.max_check_time)
+		af_stats.max_check_time = gap;
+
+	// Running mean, weighted towards recent checks once AF_MIN_CHECKS have been taken
+	int16_t score = si468x_FM_rsq_score(&status) * 4;
+	if (af_candidates[candidate].checks < AF_MIN_CHECKS)
+		af_candidates[candidate].checks++;
+	af_candidates[candidate].score += (score - af_candidates[candidate].score) / af_candidates[candidate].checks;
 
-		uint8_t minutes = (date_and_time & 0x0FC0) >> 5;
-		// !!!
+	if (af_candidates[candidate].checks >= AF_MIN_CHECKS && status.valid
+			&& af_candidates[candidate].score / 4 >= tuned_score + AF_SWITCH_MARGIN)
+		si468x_FM_AF_switch(candidate, rds->pi);
+}
+
+uint8_t si468x_FM_AF_switch(uint8_t candidate, uint16_t pi)
+{
+	Freq_kHz previous_freq = tuned_freq;
+	si468x_FM_tune_mode(af_candidates[candidate].freq, FM_TUNE_MODE_AF_TUNE);
+	if (si468x_FM_wait_for_pi(AF_PI_TIMEOUT) == pi)
+	{
+		af_stats.switches++;
+		rds_reset();
+		si468x_FM_AF_reset();
+		return 1;
 	}
+
+	// Different programme, or no RDS in time: go back and leave this AF alone for a while
+	af_stats.failed_switches++;
+	af_candidates[candidate].blocked_until = HAL_GetTick() + AF_BLOCK_TIME;
+	si468x_FM_tune_mode(previous_freq, FM_TUNE_MODE_AF_TUNE);
+	return 0;
+}
+
+int16_t si468x_FM_rsq_score(const FM_RSQ_Status *status)
+{
+	FM_Station station = {status->freq, FM_NO_PI, status->rssi, status->snr, status->multipath};
+	return FM_stations_score(&station);
+}
+
+void si468x_FM_AF_get_stats(FM_AF_Stats *stats)
+{
+	*stats = af_stats;
 }
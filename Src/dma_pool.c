@@ -0,0 +1,111 @@
+#include "dma_pool.h"
+#include "stm32f7xx_hal.h"
+
+#define SLOTS_FOR(size) (((size) + DMA_POOL_SLOT_SIZE - 1) / DMA_POOL_SLOT_SIZE)
+
+// Mapped non-cacheable by dma_pool_init, so DMA and the CPU always agree and no cache maintenance is needed
+static uint8_t pool[DMA_POOL_SIZE] __attribute__((aligned(DMA_POOL_SIZE)));
+static uint32_t used[DMA_POOL_SLOTS / 32];
+static uint16_t run_length[DMA_POOL_SLOTS]; // Slots held by the allocation starting at each slot
+static DMA_Pool_Stats stats;
+
+static uint8_t slot_used(uint16_t slot);
+static void mark_run(uint16_t first, uint16_t count, uint8_t set);
+
+// Call before the D-cache is enabled
+void dma_pool_init()
+{
+	MPU_Region_InitTypeDef region;
+	HAL_MPU_Disable();
+	region.Enable = MPU_REGION_ENABLE;
+	region.Number = MPU_REGION_NUMBER0;
+	region.BaseAddress = (uint32_t) pool;
+	region.Size = MPU_REGION_SIZE_16KB;
+	region.SubRegionDisable = 0x00;
+	region.TypeExtField = MPU_TEX_LEVEL1; // TEX 1, C 0, B 0: normal memory, non-cacheable
+	region.AccessPermission = MPU_REGION_FULL_ACCESS;
+	region.DisableExec = MPU_INSTRUCTION_ACCESS_DISABLE;
+	region.IsShareable = MPU_ACCESS_SHAREABLE;
+	region.IsCacheable = MPU_ACCESS_NOT_CACHEABLE;
+	region.IsBufferable = MPU_ACCESS_NOT_BUFFERABLE;
+	HAL_MPU_ConfigRegion(&region);
+	HAL_MPU_Enable(MPU_PRIVILEGED_DEFAULT);
+}
+
+// First fit, whole slots so no two buffers share a cache line. Safe from interrupts, returns NULL when full
+void *dma_pool_alloc(uint16_t size)
+{
+	uint16_t count = SLOTS_FOR(size ? size : 1);
+	void *buffer = NULL;
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	uint16_t free_run = 0;
+	for (uint16_t slot = 0; slot < DMA_POOL_SLOTS; slot++)
+	{
+		if (slot_used(slot))
+		{
+			slot += run_length[slot] - 1;
+			free_run = 0;
+			continue;
+		}
+		if (++free_run < count)
+			continue;
+
+		uint16_t first = slot + 1 - count;
+		mark_run(first, count, 1);
+		run_length[first] = count;
+		stats.allocs++;
+		stats.used_slots += count;
+		if (stats.used_slots > stats.peak_slots)
+			stats.peak_slots = stats.used_slots;
+		buffer = &pool[first * DMA_POOL_SLOT_SIZE];
+		break;
+	}
+	if (!buffer)
+		stats.failures++;
+	__set_PRIMASK(primask);
+	return buffer;
+}
+
+void dma_pool_free(void *buffer)
+{
+	if (!buffer)
+		return;
+
+	uint16_t first = ((uint8_t *) buffer - pool) / DMA_POOL_SLOT_SIZE;
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	uint16_t count = run_length[first];
+	mark_run(first, count, 0);
+	run_length[first] = 0;
+	stats.used_slots -= count;
+	__set_PRIMASK(primask);
+}
+
+uint8_t dma_pool_contains(const void *buffer, uint16_t size)
+{
+	const uint8_t *start = (const uint8_t *) buffer;
+	return start >= pool && start + size <= pool + DMA_POOL_SIZE;
+}
+
+void dma_pool_get_stats(DMA_Pool_Stats *out)
+{
+	*out = stats;
+}
+
+uint8_t slot_used(uint16_t slot)
+{
+	return (used[slot / 32] >> (slot % 32)) & 0x01;
+}
+
+void mark_run(uint16_t first, uint16_t count, uint8_t set)
+{
+	for (uint16_t slot = first; slot < first + count; slot++)
+	{
+		if (set)
+			used[slot / 32] |= 1UL << (slot % 32);
+		else
+			used[slot / 32] &= ~(1UL << (slot % 32));
+	}
+}
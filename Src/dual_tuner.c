@@ -0,0 +1,144 @@
+#include "dual_tuner.h"
+#include "stm32f7xx_hal.h"
+#include "AR1010.h"
+#include "Si468x/Si468x.h"
+
+#define DUAL_TUNER_BAND			BAND_FM_EUROPE // The AR1010 channel raster
+#define DUAL_TUNER_CHANNELS		FREQ_RASTER_CHANNELS(FM_EUROPE_BOTTOM, FM_EUROPE_TOP, FM_EUROPE_SPACING)
+#define DUAL_TUNER_STEP_INTERVAL	10 // ms, minimum between background tunes
+#define DUAL_TUNER_STATION_RSSI		20 // A map peak at least this strong counts as a station
+
+static uint8_t enabled = 0;
+static uint8_t valid = 0;
+static uint8_t rssi_map[DUAL_TUNER_CHANNELS];
+static uint16_t next_channel;
+static uint32_t last_step;
+static uint32_t hold_until;
+static uint32_t sweep_start;
+static FM_Station_List stations;
+static Dual_Tuner_Stats stats;
+
+static void on_tuned(const AR1010_Result *result);
+static void build_station_list();
+
+void dual_tuner_enable(uint8_t enable)
+{
+	enabled = enable;
+	AR1010_set_mute(enable);
+	next_channel = 0;
+	sweep_start = HAL_GetTick();
+}
+
+// One AR1010 transaction at a time, and only while the Si468x has nothing waiting, so foreground commands never queue behind a sweep
+void dual_tuner_task()
+{
+	if (!enabled)
+		return;
+	if (si468x_async_pending(si468x_device) || si468x_interrupt_pending(si468x_device))
+	{
+		stats.deferred_steps++;
+		return;
+	}
+	AR1010_task(); // Polls STC at its own bounded rate, on_tuned runs from here
+	if (AR1010_busy())
+		return;
+
+	uint32_t tick = HAL_GetTick();
+	if ((int32_t) (hold_until - tick) > 0)
+	{
+		stats.deferred_steps++;
+		return;
+	}
+	if (tick - last_step < DUAL_TUNER_STEP_INTERVAL)
+		return;
+	last_step = tick;
+	AR1010_tune_async(freq_from_channel(DUAL_TUNER_BAND, next_channel), on_tuned);
+}
+
+// Keeps the background off the bus, for foreground sequences that are timing sensitive
+void dual_tuner_hold(uint16_t ms)
+{
+	uint32_t until = HAL_GetTick() + ms;
+	if ((int32_t) (until - hold_until) > 0)
+		hold_until = until;
+}
+
+// Set once the first full sweep has completed
+uint8_t dual_tuner_valid()
+{
+	return valid;
+}
+
+uint8_t dual_tuner_get_rssi(Freq_kHz freq)
+{
+	if (!freq_in_band(DUAL_TUNER_BAND, freq))
+		return 0;
+	return rssi_map[freq_to_channel(DUAL_TUNER_BAND, freq)];
+}
+
+uint8_t dual_tuner_get_stations(FM_Station_List *list)
+{
+	*list = stations;
+	return list->size;
+}
+
+// Picks the best of the given frequencies (e.g. RDS AFs or linked stations), 0 if none is audible
+Freq_kHz dual_tuner_strongest(const Freq_kHz *freqs, uint8_t count)
+{
+	Freq_kHz best = 0;
+	uint8_t best_rssi = DUAL_TUNER_STATION_RSSI - 1;
+	for (uint8_t i = 0; i < count; i++)
+	{
+		uint8_t rssi = dual_tuner_get_rssi(freqs[i]);
+		if (rssi > best_rssi)
+		{
+			best = freqs[i];
+			best_rssi = rssi;
+		}
+	}
+	return best;
+}
+
+void dual_tuner_get_stats(Dual_Tuner_Stats *out)
+{
+	*out = stats;
+}
+
+void on_tuned(const AR1010_Result *result)
+{
+	if (result->success && freq_in_band(DUAL_TUNER_BAND, result->freq))
+		rssi_map[freq_to_channel(DUAL_TUNER_BAND, result->freq)] = result->rssi;
+
+	if (++next_channel < DUAL_TUNER_CHANNELS)
+		return;
+	next_channel = 0;
+	build_station_list();
+	valid = 1;
+	stats.sweeps++;
+	stats.sweep_time = HAL_GetTick() - sweep_start;
+	sweep_start = HAL_GetTick();
+}
+
+// Strong stations bleed into the neighbouring channels, only local maxima are kept
+void build_station_list()
+{
+	FM_stations_clear(&stations);
+	for (uint16_t i = 0; i < DUAL_TUNER_CHANNELS; i++)
+	{
+		uint8_t rssi = rssi_map[i];
+		if (rssi < DUAL_TUNER_STATION_RSSI)
+			continue;
+		if ((i > 0 && rssi_map[i - 1] >= rssi) || (i + 1 < DUAL_TUNER_CHANNELS && rssi_map[i + 1] > rssi))
+			continue;
+
+		FM_Station station;
+		station.freq = freq_from_channel(DUAL_TUNER_BAND, i);
+		station.pi = FM_NO_PI;
+		station.rssi = rssi;
+		station.snr = 0;
+		station.multipath = 0;
+		FM_stations_add(&stations, &station);
+	}
+	FM_stations_rank(&stations);
+	stations.scan_time = HAL_GetTick() - sweep_start;
+}
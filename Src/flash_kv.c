@@ -0,0 +1,539 @@
+#include "flash_kv.h"
+#include "flash_map.h"
+#include "SST25V_flash.h"
+#include "crc32.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#define KV_MAGIC				0x4B56 // "KV"
+#define KV_NO_SEQUENCE			0xFFFFFFFF
+#define KV_ERASED				0xFFFF
+#define KV_HEADER_SIZE			sizeof(KV_Sector_Header)
+#define KV_RECORD_HEADER_SIZE	sizeof(KV_Record_Header)
+#define KV_MAX_VALUE			(FLASH_SECTOR_SIZE - KV_HEADER_SIZE - KV_RECORD_HEADER_SIZE)
+#define KV_CRC_CHUNK			64
+
+#define RECORD_LENGTH(size)		((KV_RECORD_HEADER_SIZE + (size) + 3) & ~3)
+#define SECTOR_ADDRESS(sector)	(FLASH_KV_ADDRESS + (uint32_t) (sector) * FLASH_SECTOR_SIZE)
+#define SECTOR_OF(address)		(((address) - FLASH_KV_ADDRESS) / FLASH_SECTOR_SIZE)
+// Serial number order, so the sequence can wrap. Live sectors never span 2^31 opens
+#define SEQUENCE_AFTER(a, b)	((int32_t) ((a) - (b)) > 0)
+
+// Written straight after the erase. The sequence stays erased until the sector is opened for appends
+typedef struct
+{
+	uint16_t magic;
+	uint16_t reserved;
+	uint32_t erase_count;
+	uint32_t sequence;		// Order the sectors were filled in, later records win
+	uint32_t sequence_check;	// ~sequence, written with it so a torn write is caught
+} KV_Sector_Header;
+
+// Records are appended after the header, 4-byte aligned. A size of 0 marks the key deleted
+typedef struct
+{
+	uint16_t key;
+	uint16_t size;
+	uint32_t crc;			// Over key, size and value
+} KV_Record_Header;
+
+enum KV_Sector_State
+{
+	KV_SECTOR_DIRTY,		// Waiting for an erase
+	KV_SECTOR_ERASING,
+	KV_SECTOR_FREE,
+	KV_SECTOR_ACTIVE,		// Taking appends
+	KV_SECTOR_FULL
+};
+
+typedef struct
+{
+	uint32_t sequence;
+	uint32_t erase_count;
+	uint16_t used;
+	uint16_t live;			// Bytes of records still in the index
+	uint8_t state;
+} KV_Sector;
+
+// Deleted keys keep their entry with size 0, so the tombstone moves with compaction and the old value can't come back
+typedef struct
+{
+	uint16_t key;
+	uint16_t size;
+	uint32_t address;		// Record header
+} KV_Entry;
+
+// A write that found no erased sector, held until flash_kv_task has made room
+typedef struct
+{
+	uint16_t key;
+	uint16_t size;
+	uint8_t *data;
+	uint8_t used;
+} KV_Pending;
+
+static KV_Sector sectors[FLASH_KV_SECTORS];
+static KV_Entry entries[FLASH_KV_MAX_KEYS];
+static uint16_t num_entries = 0;
+static int16_t active = -1;
+static int16_t erasing = -1;
+static KV_Pending pending[FLASH_KV_MAX_PENDING];
+static uint32_t next_sequence = 0;
+static Flash_KV_Stats stats;
+
+static void scan_sector(uint8_t sector);
+static uint32_t record_crc(uint32_t address, const KV_Record_Header *record);
+static void index_record(uint8_t sector, uint32_t address, const KV_Record_Header *record);
+static KV_Entry *find(uint16_t key);
+static uint8_t append(uint16_t key, const void *data, uint16_t size, uint8_t compacting);
+static uint8_t open_sector();
+static uint8_t start_erase();
+static void finish_erase();
+static uint8_t write_or_defer(uint16_t key, const void *data, uint16_t size);
+static KV_Pending *find_pending(uint16_t key);
+static void drop_pending(KV_Pending *entry);
+static void flush_pending();
+static uint8_t compact();
+static uint8_t free_sectors();
+static uint32_t wear_gap();
+
+// Rebuilds the index with one pass over the log, oldest sector first
+void flash_kv_init()
+{
+	memset(sectors, 0, sizeof(sectors));
+	num_entries = 0;
+	active = -1;
+	erasing = -1;
+	for (uint8_t i = 0; i < FLASH_KV_MAX_PENDING; i++)
+		drop_pending(&pending[i]);
+	next_sequence = 0;
+
+	uint8_t order[FLASH_KV_SECTORS];
+	uint8_t num_ordered = 0;
+	uint32_t max_erase_count = 0;
+	for (uint8_t sector = 0; sector < FLASH_KV_SECTORS; sector++)
+	{
+		KV_Sector_Header header;
+		SST25_read(SECTOR_ADDRESS(sector), (uint8_t *) &header, KV_HEADER_SIZE);
+		sectors[sector].used = KV_HEADER_SIZE;
+		if (header.magic != KV_MAGIC)
+		{
+			sectors[sector].state = KV_SECTOR_DIRTY; // Never formatted, or the erase was cut short
+			continue;
+		}
+
+		sectors[sector].erase_count = header.erase_count;
+		if (header.erase_count > max_erase_count)
+			max_erase_count = header.erase_count;
+		if (header.sequence == KV_NO_SEQUENCE && header.sequence_check == KV_NO_SEQUENCE)
+		{
+			sectors[sector].state = KV_SECTOR_FREE;
+			continue;
+		}
+		if (header.sequence == KV_NO_SEQUENCE || header.sequence_check != ~header.sequence)
+		{
+			sectors[sector].state = KV_SECTOR_DIRTY; // Reset while the sequence was written, no records follow it yet
+			continue;
+		}
+
+		sectors[sector].sequence = header.sequence;
+		sectors[sector].state = KV_SECTOR_FULL;
+		uint8_t i = num_ordered++;
+		for (; i > 0 && SEQUENCE_AFTER(sectors[order[i - 1]].sequence, header.sequence); i--)
+			order[i] = order[i - 1];
+		order[i] = sector;
+	}
+	if (num_ordered)
+		next_sequence = sectors[order[num_ordered - 1]].sequence + 1;
+
+	for (uint8_t i = 0; i < num_ordered; i++)
+		scan_sector(order[i]);
+	if (num_ordered && sectors[order[num_ordered - 1]].used < FLASH_SECTOR_SIZE)
+	{
+		active = order[num_ordered - 1];
+		sectors[active].state = KV_SECTOR_ACTIVE;
+	}
+
+	// A lost erase count is taken as the most worn one, levelling then never favours the sector
+	for (uint8_t sector = 0; sector < FLASH_KV_SECTORS; sector++)
+		if (sectors[sector].state == KV_SECTOR_DIRTY)
+			sectors[sector].erase_count = max_erase_count;
+
+	// Only on a blank or foreign chip, after that erases happen in flash_kv_task
+	while (free_sectors() < FLASH_KV_MIN_FREE && start_erase())
+	{
+		while (SST25_erase_busy())
+			;
+		finish_erase();
+	}
+}
+
+// Never waits on the flash: an erase is started here and its end picked up on a later call. Otherwise writes
+// held for lack of space go out, then one compaction keeps FLASH_KV_MIN_FREE sectors erased ahead of the writers
+void flash_kv_task()
+{
+	if (erasing >= 0)
+	{
+		if (SST25_erase_busy())
+			return;
+		finish_erase();
+	}
+	flush_pending();
+	if (start_erase())
+		return;
+	if (free_sectors() < FLASH_KV_MIN_FREE || wear_gap() > FLASH_KV_WEAR_SPREAD)
+		compact();
+}
+
+// 0 if the key has no value
+uint16_t flash_kv_size(uint16_t key)
+{
+	KV_Pending *held = find_pending(key);
+	if (held)
+		return held->size;
+	KV_Entry *entry = find(key);
+	return entry ? entry->size : 0;
+}
+
+// Reads up to size bytes of the value
+uint8_t flash_kv_read(uint16_t key, void *data, uint16_t size)
+{
+	KV_Pending *held = find_pending(key);
+	if (held)
+	{
+		if (!held->size)
+			return FLASH_KV_NOT_FOUND;
+		memcpy(data, held->data, size < held->size ? size : held->size);
+		return FLASH_KV_OK;
+	}
+
+	KV_Entry *entry = find(key);
+	if (!entry || !entry->size)
+		return FLASH_KV_NOT_FOUND;
+
+	SST25_read(entry->address + KV_RECORD_HEADER_SIZE, (uint8_t *) data, size < entry->size ? size : entry->size);
+	return FLASH_KV_OK;
+}
+
+// Appends, never erases. With no erased sector ready the value is held in RAM for flash_kv_task, FLASH_KV_PENDING.
+// FLASH_KV_FULL only when that is not possible either. An empty value deletes the key
+uint8_t flash_kv_write(uint16_t key, const void *data, uint16_t size)
+{
+	if (!size)
+		return flash_kv_delete(key);
+	return write_or_defer(key, data, size);
+}
+
+uint8_t flash_kv_delete(uint16_t key)
+{
+	if (!flash_kv_size(key))
+		return FLASH_KV_NOT_FOUND;
+	return write_or_defer(key, NULL, 0);
+}
+
+void flash_kv_get_stats(Flash_KV_Stats *out)
+{
+	stats.min_erase_count = UINT32_MAX;
+	stats.max_erase_count = 0;
+	for (uint8_t sector = 0; sector < FLASH_KV_SECTORS; sector++)
+	{
+		if (sectors[sector].erase_count < stats.min_erase_count)
+			stats.min_erase_count = sectors[sector].erase_count;
+		if (sectors[sector].erase_count > stats.max_erase_count)
+			stats.max_erase_count = sectors[sector].erase_count;
+	}
+	stats.free_sectors = free_sectors();
+	stats.keys = 0;
+	for (uint16_t i = 0; i < num_entries; i++)
+		if (entries[i].size)
+			stats.keys++;
+	*out = stats;
+}
+
+void scan_sector(uint8_t sector)
+{
+	uint16_t offset = KV_HEADER_SIZE;
+	while (offset + KV_RECORD_HEADER_SIZE <= FLASH_SECTOR_SIZE)
+	{
+		KV_Record_Header record;
+		uint32_t address = SECTOR_ADDRESS(sector) + offset;
+		SST25_read(address, (uint8_t *) &record, KV_RECORD_HEADER_SIZE);
+		if (record.key == KV_ERASED && record.size == KV_ERASED)
+			break; // End of the log in this sector
+		if (record.key == KV_ERASED || offset + RECORD_LENGTH(record.size) > FLASH_SECTOR_SIZE)
+		{
+			offset = FLASH_SECTOR_SIZE; // Torn header, nothing after it can be trusted
+			break;
+		}
+
+		if (record_crc(address, &record) == record.crc)
+			index_record(sector, address, &record);
+		else
+			stats.corrupt_records++; // Cut short by a reset, the key keeps its previous value
+		offset += RECORD_LENGTH(record.size);
+	}
+	sectors[sector].used = offset;
+}
+
+uint32_t record_crc(uint32_t address, const KV_Record_Header *record)
+{
+	uint32_t crc = crc32_update(CRC32_INIT, (const uint8_t *) record, offsetof(KV_Record_Header, crc));
+	uint8_t chunk[KV_CRC_CHUNK];
+	for (uint16_t done = 0; done < record->size; )
+	{
+		uint16_t size = record->size - done > KV_CRC_CHUNK ? KV_CRC_CHUNK : record->size - done;
+		SST25_read(address + KV_RECORD_HEADER_SIZE + done, chunk, size);
+		crc = crc32_update(crc, chunk, size);
+		done += size;
+	}
+	return crc ^ CRC32_INIT;
+}
+
+void index_record(uint8_t sector, uint32_t address, const KV_Record_Header *record)
+{
+	KV_Entry *entry = find(record->key);
+	if (entry)
+		sectors[SECTOR_OF(entry->address)].live -= RECORD_LENGTH(entry->size);
+	else if (num_entries < FLASH_KV_MAX_KEYS)
+	{
+		entry = &entries[num_entries++];
+		entry->key = record->key;
+	}
+	else
+		return;
+
+	entry->size = record->size;
+	entry->address = address;
+	sectors[sector].live += RECORD_LENGTH(record->size);
+}
+
+KV_Entry *find(uint16_t key)
+{
+	for (uint16_t i = 0; i < num_entries; i++)
+		if (entries[i].key == key)
+			return &entries[i];
+	return NULL;
+}
+
+// User writes leave the last erased sector to compaction, so there is always somewhere to move live data
+uint8_t append(uint16_t key, const void *data, uint16_t size, uint8_t compacting)
+{
+	if (size > KV_MAX_VALUE)
+		return FLASH_KV_TOO_LARGE;
+	if (!find(key) && num_entries >= FLASH_KV_MAX_KEYS)
+		return FLASH_KV_FULL;
+
+	uint16_t length = RECORD_LENGTH(size);
+	if (active < 0 || sectors[active].used + length > FLASH_SECTOR_SIZE)
+	{
+		if (free_sectors() <= (compacting ? 0 : FLASH_KV_MIN_FREE - 1) || open_sector())
+			return FLASH_KV_FULL;
+	}
+
+	KV_Record_Header record = {key, size, 0};
+	record.crc = crc32_update(crc32_update(CRC32_INIT, (const uint8_t *) &record, offsetof(KV_Record_Header, crc)), (const uint8_t *) data, size) ^ CRC32_INIT;
+	uint32_t address = SECTOR_ADDRESS(active) + sectors[active].used;
+	SST25_write(address, (uint8_t *) &record, KV_RECORD_HEADER_SIZE);
+	if (size)
+		SST25_write(address + KV_RECORD_HEADER_SIZE, (uint8_t *) data, size);
+	sectors[active].used += length;
+	index_record(active, address, &record);
+
+	stats.writes++;
+	stats.bytes_written += length;
+	return FLASH_KV_OK;
+}
+
+// Takes the least worn erased sector, so erases spread over the whole region
+uint8_t open_sector()
+{
+	int16_t best = -1;
+	for (uint8_t sector = 0; sector < FLASH_KV_SECTORS; sector++)
+		if (sectors[sector].state == KV_SECTOR_FREE && (best < 0 || sectors[sector].erase_count < sectors[best].erase_count))
+			best = sector;
+	if (best < 0)
+		return 1;
+
+	if (active >= 0)
+		sectors[active].state = KV_SECTOR_FULL;
+	if (next_sequence == KV_NO_SEQUENCE)
+		next_sequence = 0;
+	uint32_t sequence[2] = {next_sequence, ~next_sequence};
+	next_sequence++;
+	SST25_write(SECTOR_ADDRESS(best) + offsetof(KV_Sector_Header, sequence), (uint8_t *) sequence, sizeof(sequence));
+	sectors[best].sequence = sequence[0];
+	sectors[best].state = KV_SECTOR_ACTIVE;
+	sectors[best].used = KV_HEADER_SIZE;
+	sectors[best].live = 0;
+	active = best;
+	return 0;
+}
+
+// Returns 1 if an erase was started
+uint8_t start_erase()
+{
+	for (uint8_t sector = 0; sector < FLASH_KV_SECTORS; sector++)
+	{
+		if (sectors[sector].state != KV_SECTOR_DIRTY)
+			continue;
+
+		SST25_sector_erase_4K_start(SECTOR_ADDRESS(sector));
+		sectors[sector].state = KV_SECTOR_ERASING;
+		erasing = sector;
+		return 1;
+	}
+	return 0;
+}
+
+// Once BUSY has cleared. A reset before the magic is written leaves the sector dirty, and it is erased again.
+// The erase count goes first so a valid magic always comes with a whole count
+void finish_erase()
+{
+	KV_Sector *sector = &sectors[erasing];
+	KV_Sector_Header header = {KV_MAGIC, KV_ERASED, sector->erase_count + 1, KV_NO_SEQUENCE, KV_NO_SEQUENCE};
+	SST25_write(SECTOR_ADDRESS(erasing) + offsetof(KV_Sector_Header, erase_count), (uint8_t *) &header.erase_count, sizeof(header.erase_count));
+	SST25_write(SECTOR_ADDRESS(erasing), (uint8_t *) &header, offsetof(KV_Sector_Header, erase_count));
+	sector->erase_count++;
+	sector->state = KV_SECTOR_FREE;
+	sector->used = KV_HEADER_SIZE;
+	sector->live = 0;
+	stats.erases++;
+	erasing = -1;
+}
+
+uint8_t write_or_defer(uint16_t key, const void *data, uint16_t size)
+{
+	uint8_t status = append(key, data, size, 0);
+	KV_Pending *held = find_pending(key);
+	if (status != FLASH_KV_FULL || (!held && !find(key) && num_entries >= FLASH_KV_MAX_KEYS))
+	{
+		if (status == FLASH_KV_OK)
+			drop_pending(held); // Older than what was just written
+		else if (status == FLASH_KV_FULL)
+			stats.failed_writes++;
+		return status;
+	}
+
+	// Out of erased sectors, keep a copy. A later write of the same key replaces it
+	if (!held)
+		held = find_pending(KV_ERASED);
+	uint8_t *copy = size ? (uint8_t *) malloc(size) : NULL;
+	if (!held || (size && !copy))
+	{
+		free(copy);
+		stats.failed_writes++;
+		return FLASH_KV_FULL;
+	}
+	drop_pending(held);
+	if (size)
+		memcpy(copy, data, size);
+	held->key = key;
+	held->size = size;
+	held->data = copy;
+	held->used = 1;
+	stats.deferred_writes++;
+	return FLASH_KV_PENDING;
+}
+
+// KV_ERASED finds a free slot
+KV_Pending *find_pending(uint16_t key)
+{
+	for (uint8_t i = 0; i < FLASH_KV_MAX_PENDING; i++)
+		if (pending[i].used ? pending[i].key == key : key == KV_ERASED)
+			return &pending[i];
+	return NULL;
+}
+
+void drop_pending(KV_Pending *entry)
+{
+	if (!entry)
+		return;
+	free(entry->data);
+	entry->data = NULL;
+	entry->used = 0;
+}
+
+// Stops at the first write that still finds no room
+void flush_pending()
+{
+	for (uint8_t i = 0; i < FLASH_KV_MAX_PENDING; i++)
+	{
+		if (!pending[i].used)
+			continue;
+		uint8_t status = append(pending[i].key, pending[i].data, pending[i].size, 0);
+		if (status == FLASH_KV_FULL && (find(pending[i].key) || num_entries < FLASH_KV_MAX_KEYS))
+			return;
+		if (status != FLASH_KV_OK)
+			stats.failed_writes++; // The key table filled up while it was held
+		drop_pending(&pending[i]);
+	}
+}
+
+// Moves the live records out of one full sector and queues it for erase. The victim is the sector with the least
+// live data, or the least worn one once the wear gap is too wide, since static data would otherwise pin it forever
+uint8_t compact()
+{
+	uint8_t level = wear_gap() > FLASH_KV_WEAR_SPREAD;
+	int16_t victim = -1;
+	for (uint8_t sector = 0; sector < FLASH_KV_SECTORS; sector++)
+	{
+		if (sectors[sector].state != KV_SECTOR_FULL)
+			continue;
+		if (victim < 0
+				|| (level && sectors[sector].erase_count < sectors[victim].erase_count)
+				|| (!level && sectors[sector].live < sectors[victim].live))
+			victim = sector;
+	}
+	if (victim < 0 || (!level && sectors[victim].live >= sectors[victim].used - KV_HEADER_SIZE))
+		return 0; // Nothing to reclaim
+
+	for (uint16_t i = 0; i < num_entries; i++)
+	{
+		KV_Entry *entry = &entries[i];
+		if (SECTOR_OF(entry->address) != victim)
+			continue;
+
+		uint8_t *value = NULL;
+		if (entry->size)
+		{
+			value = (uint8_t *) malloc(entry->size);
+			if (!value)
+				return 0;
+			SST25_read(entry->address + KV_RECORD_HEADER_SIZE, value, entry->size);
+		}
+		uint8_t status = append(entry->key, value, entry->size, 1);
+		free(value);
+		if (status != FLASH_KV_OK)
+			return 0;
+		stats.relocated_bytes += RECORD_LENGTH(entry->size);
+	}
+
+	sectors[victim].state = KV_SECTOR_DIRTY;
+	stats.compactions++;
+	return 1;
+}
+
+uint8_t free_sectors()
+{
+	uint8_t count = 0;
+	for (uint8_t sector = 0; sector < FLASH_KV_SECTORS; sector++)
+		if (sectors[sector].state == KV_SECTOR_FREE)
+			count++;
+	return count;
+}
+
+// Most worn sector against the least worn one holding data
+uint32_t wear_gap()
+{
+	uint32_t min = UINT32_MAX;
+	uint32_t max = 0;
+	for (uint8_t sector = 0; sector < FLASH_KV_SECTORS; sector++)
+	{
+		if (sectors[sector].erase_count > max)
+			max = sectors[sector].erase_count;
+		if (sectors[sector].state == KV_SECTOR_FULL && sectors[sector].erase_count < min)
+			min = sectors[sector].erase_count;
+	}
+	return min == UINT32_MAX ? 0 : max - min;
+}
@@ -0,0 +1,36 @@
+#include "frequency.h"
+
+const Freq_Raster freq_rasters[NUM_FREQ_BANDS] = {
+		{FM_EUROPE_BOTTOM, FM_EUROPE_TOP, FM_EUROPE_SPACING, FREQ_RASTER_CHANNELS(FM_EUROPE_BOTTOM, FM_EUROPE_TOP, FM_EUROPE_SPACING)},
+		{FM_US_BOTTOM, FM_US_TOP, FM_US_SPACING, FREQ_RASTER_CHANNELS(FM_US_BOTTOM, FM_US_TOP, FM_US_SPACING)},
+		{FM_JAPAN_BOTTOM, FM_JAPAN_TOP, FM_JAPAN_SPACING, FREQ_RASTER_CHANNELS(FM_JAPAN_BOTTOM, FM_JAPAN_TOP, FM_JAPAN_SPACING)}
+};
+
+uint8_t freq_in_band(enum Freq_Band band, Freq_kHz freq)
+{
+	return freq >= freq_rasters[band].bottom && freq <= freq_rasters[band].top;
+}
+
+// Nearest channel, clamped to the band
+uint16_t freq_to_channel(enum Freq_Band band, Freq_kHz freq)
+{
+	const Freq_Raster *raster = &freq_rasters[band];
+	if (freq <= raster->bottom)
+		return 0;
+	if (freq >= raster->top)
+		return raster->channels - 1;
+	return (freq - raster->bottom + raster->spacing / 2) / raster->spacing;
+}
+
+Freq_kHz freq_from_channel(enum Freq_Band band, uint16_t channel)
+{
+	const Freq_Raster *raster = &freq_rasters[band];
+	if (channel >= raster->channels)
+		channel = raster->channels - 1;
+	return raster->bottom + (Freq_kHz) channel * raster->spacing;
+}
+
+Freq_kHz freq_snap(enum Freq_Band band, Freq_kHz freq)
+{
+	return freq_from_channel(band, freq_to_channel(band, freq));
+}
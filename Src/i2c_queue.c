@@ -0,0 +1,205 @@
+#include "i2c_queue.h"
+#include "i2c.h"
+#include "dma_pool.h"
+#include "cycle_counter.h"
+#include <string.h>
+
+enum I2C_Phase
+{
+	PHASE_IDLE,
+	PHASE_TX,		// Write, possibly followed by a separate read
+	PHASE_RX
+};
+
+static I2C_Job ring[I2C_QUEUE_SIZE];
+static volatile uint8_t head = 0; // Next free slot, only moved by submit
+static volatile uint8_t tail = 0; // Job on the bus, only moved by the interrupt
+static volatile uint8_t phase = PHASE_IDLE;
+static uint8_t *caller_tx[I2C_QUEUE_SIZE]; // Set when the job was staged through the DMA pool
+static uint8_t *caller_rx[I2C_QUEUE_SIZE];
+static uint32_t job_start;
+static I2C_Queue_Stats stats;
+
+static void start_job();
+static void start_rx(I2C_Job *job);
+static void finish_job(uint8_t status);
+static void blocking_done(const I2C_Job *job);
+static uint8_t *stage(uint8_t *buffer, uint16_t size, uint8_t **caller);
+
+// Returns 1 if the ring is full. The job is copied, only its buffers have to outlive the call
+uint8_t i2c_queue_submit(const I2C_Job *job)
+{
+	uint8_t next = (head + 1) % I2C_QUEUE_SIZE;
+	if (next == tail)
+	{
+		stats.rejected++;
+		return 1;
+	}
+
+	ring[head] = *job;
+	ring[head].status = I2C_JOB_PENDING;
+	ring[head].tx = stage(job->tx, job->tx_size, &caller_tx[head]);
+	ring[head].rx = stage(job->rx, job->rx_size, &caller_rx[head]);
+	if (caller_tx[head])
+		memcpy(ring[head].tx, job->tx, job->tx_size);
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	head = next;
+	uint8_t depth = (head + I2C_QUEUE_SIZE - tail) % I2C_QUEUE_SIZE;
+	if (depth > stats.max_depth)
+		stats.max_depth = depth;
+	if (phase == PHASE_IDLE)
+		start_job();
+	__set_PRIMASK(primask);
+	return 0;
+}
+
+uint8_t i2c_queue_busy()
+{
+	return phase != PHASE_IDLE;
+}
+
+void i2c_queue_get_stats(I2C_Queue_Stats *out)
+{
+	*out = stats;
+}
+
+void I2C_write(uint8_t address, uint8_t *data, uint16_t size)
+{
+	I2C_write_read(address, data, size, 0, 0);
+}
+
+void I2C_read(uint8_t address, uint8_t *read_buffer, uint16_t size)
+{
+	I2C_write_read(address, 0, 0, read_buffer, size);
+}
+
+void I2C_write_read(uint8_t address, uint8_t *data, uint16_t size, uint8_t *read_buffer, uint16_t read_size)
+{
+	volatile uint8_t status = I2C_JOB_PENDING;
+	I2C_Job job = {address, data, size, read_buffer, read_size, blocking_done, (void *) &status};
+	while (i2c_queue_submit(&job))
+		;
+	while (status == I2C_JOB_PENDING)
+		;
+	if (status == I2C_JOB_ERROR)
+		Error_Handler();
+}
+
+void blocking_done(const I2C_Job *job)
+{
+	*(volatile uint8_t *) job->context = job->status;
+}
+
+// Buffers outside the pool are copied through a pool slot. Only when the pool is full does the job fall back to cache maintenance
+uint8_t *stage(uint8_t *buffer, uint16_t size, uint8_t **caller)
+{
+	*caller = NULL;
+	if (!size || dma_pool_contains(buffer, size))
+		return buffer;
+
+	uint8_t *staged = (uint8_t *) dma_pool_alloc(size);
+	if (staged)
+	{
+		*caller = buffer;
+		stats.staged_bytes += size;
+		return staged;
+	}
+
+	stats.unstaged++;
+	SCB_CleanInvalidateDCache_by_Addr((void *) buffer, size);
+	return buffer;
+}
+
+// Called with interrupts off, or from the interrupt
+void start_job()
+{
+	if (tail == head)
+	{
+		phase = PHASE_IDLE;
+		return;
+	}
+
+	I2C_Job *job = &ring[tail];
+	job_start = CPU_CYCLES;
+	HAL_StatusTypeDef result;
+	if (job->tx_size && job->tx_size <= 2 && job->rx_size) // Register/command byte, then a repeated start
+	{
+		phase = PHASE_RX;
+		uint16_t mem_address = job->tx_size == 1 ? job->tx[0] : (job->tx[0] << 8) | job->tx[1];
+		uint16_t mem_size = job->tx_size == 1 ? I2C_MEMADD_SIZE_8BIT : I2C_MEMADD_SIZE_16BIT;
+		result = HAL_I2C_Mem_Read_DMA(&hi2c1, job->address << 1, mem_address, mem_size, job->rx, job->rx_size);
+	}
+	else if (job->tx_size)
+	{
+		phase = PHASE_TX;
+		result = HAL_I2C_Master_Transmit_DMA(&hi2c1, job->address << 1, job->tx, job->tx_size);
+	}
+	else
+	{
+		phase = PHASE_RX;
+		result = HAL_I2C_Master_Receive_DMA(&hi2c1, job->address << 1, job->rx, job->rx_size);
+	}
+	if (result != HAL_OK)
+		finish_job(I2C_JOB_ERROR);
+}
+
+void start_rx(I2C_Job *job)
+{
+	phase = PHASE_RX;
+	if (HAL_I2C_Master_Receive_DMA(&hi2c1, job->address << 1, job->rx, job->rx_size) != HAL_OK)
+		finish_job(I2C_JOB_ERROR);
+}
+
+// Hands the result over and chains straight into the next job
+void finish_job(uint8_t status)
+{
+	I2C_Job *job = &ring[tail];
+	job->status = status;
+	if (caller_tx[tail])
+	{
+		dma_pool_free(job->tx);
+		job->tx = caller_tx[tail];
+	}
+	if (caller_rx[tail])
+	{
+		memcpy(caller_rx[tail], job->rx, job->rx_size);
+		dma_pool_free(job->rx);
+		job->rx = caller_rx[tail];
+	}
+	stats.jobs++;
+	stats.bytes += job->tx_size + job->rx_size;
+	stats.busy_cycles += CPU_CYCLES - job_start;
+	if (status == I2C_JOB_ERROR)
+		stats.errors++;
+	if (job->callback)
+		job->callback(job);
+
+	tail = (tail + 1) % I2C_QUEUE_SIZE;
+	start_job();
+}
+
+void HAL_I2C_MasterTxCpltCallback(I2C_HandleTypeDef *hi2c)
+{
+	I2C_Job *job = &ring[tail];
+	if (phase == PHASE_TX && job->rx_size) // Longer writes can't use the repeated start, read after the stop
+		start_rx(job);
+	else
+		finish_job(I2C_JOB_DONE);
+}
+
+void HAL_I2C_MasterRxCpltCallback(I2C_HandleTypeDef *hi2c)
+{
+	finish_job(I2C_JOB_DONE);
+}
+
+void HAL_I2C_MemRxCpltCallback(I2C_HandleTypeDef *hi2c)
+{
+	finish_job(I2C_JOB_DONE);
+}
+
+void HAL_I2C_ErrorCallback(I2C_HandleTypeDef *hi2c)
+{
+	finish_job(I2C_JOB_ERROR);
+}
@@ -50,7 +50,7 @@
 I2S_HandleTypeDef hi2s2;
 I2S_HandleTypeDef hi2s3;
 DMA_HandleTypeDef hdma_spi2_rx;
-DMA_HandleTypeDef hdma_spi3_tx;
+extern DMA_HandleTypeDef hdma_spi3_tx; // SPI3 runs the flash, its TX stream is defined in spi.c
 
 /* I2S2 init function */
 void MX_I2S2_Init(void)
@@ -42,6 +42,7 @@
 #include "dma.h"
 #include "i2c.h"
 #include "sai.h"
+#include "rtc.h"
 #include "spi.h"
 #include "gpio.h"
 
@@ -50,7 +51,14 @@
 #include "Si468x/Si468x_FM.h"
 #include "Si468x/Si468x_DAB.h"
 #include "AR1010.h"
+#include "dual_tuner.h"
+#include "service_link.h"
+#include "dma_pool.h"
+#include "flash_kv.h"
+#include "tuner.h"
 #include "SST25V_flash.h"
+#include "time_service.h"
+#include "cycle_counter.h"
 #include "core_cm7.h"
 #include "string.h"
 /* USER CODE END Includes */
@@ -61,7 +69,7 @@
 /* Private variables ---------------------------------------------------------*/
 #define DWT_CTRL        (*(volatile uint32_t *)0xE0001000)
 #define CYCCNTENA       (1<<0)
-#define DWT_CYCCNT      ((volatile uint32_t *)0xE0001004)
+#define LED_INTERVAL    100 // ms, heartbeat blink. The loop itself never sleeps, each task keeps its own interval
 /* USER CODE END PV */
 
 /* Private function prototypes -----------------------------------------------*/
@@ -73,56 +81,20 @@ void SystemClock_Config(void);
 /* USER CODE END PFP */
 
 /* USER CODE BEGIN 0 */
-static uint8_t I2C_TxDMAComplete = 0;
-static uint8_t I2C_RxDMAComplete = 0;
-
-void HAL_I2C_MasterTxCpltCallback(I2C_HandleTypeDef *hi2c)
-{
-	I2C_TxDMAComplete = 1;
-}
-
-void HAL_I2C_MasterRxCpltCallback(I2C_HandleTypeDef *hi2c)
-{
-	I2C_RxDMAComplete = 1;
-}
-
-void HAL_I2C_ErrorCallback(I2C_HandleTypeDef *hi2c)
-{
-	Error_Handler();
-}
-
-void I2C_write(uint8_t address, uint8_t *data, uint16_t size)
-{
-	SCB_CleanDCache_by_Addr((void *) data, size);
-	I2C_TxDMAComplete = 0;
-	if (HAL_I2C_Master_Transmit_DMA(&hi2c1, address << 1, data, size) != HAL_OK)
-		Error_Handler();
-	while (!I2C_TxDMAComplete);
-}
-
-void I2C_read(uint8_t address, uint8_t *read_buffer, uint16_t size)
-{
-	SCB_CleanInvalidateDCache_by_Addr((void *) read_buffer, size);
-	I2C_RxDMAComplete = 0;
-	if (HAL_I2C_Master_Receive_DMA(&hi2c1, address << 1, read_buffer, size) != HAL_OK)
-		Error_Handler();
-	while (!I2C_RxDMAComplete);
-}
-
 void flash_SPI_write(uint8_t *data, uint16_t size)
 {
-	HAL_SPI_Transmit(&hspi5, data, size, 1000);
+	HAL_SPI_Transmit(&hspi3, data, size, 1000);
 }
 
 void flash_SPI_read(uint8_t *read_buffer, uint16_t size)
 {
-	HAL_SPI_Receive(&hspi5, read_buffer, size, 1000);
+	HAL_SPI_Receive(&hspi3, read_buffer, size, 1000);
 }
 
 uint8_t flash_SPI_read_write_byte(uint8_t data)
 {
 	uint8_t received;
-	HAL_SPI_TransmitReceive(&hspi5, &data, &received, 1, 1000);
+	HAL_SPI_TransmitReceive(&hspi3, &data, &received, 1, 1000);
 	return received;
 }
 
@@ -135,9 +107,11 @@ uint8_t dab_change_service = 1;
 void HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin)
 {
     if (GPIO_Pin == SI_INT_Pin)
-    	si468x_interrupt();
+    	si468x_interrupt(&si468x_main);
     if (GPIO_Pin == USER_Btn_Pin)
     	dab_change_service = 1;
+    if (GPIO_Pin == FLASH_MISO_Pin)
+    	SST25_ready_interrupt();
 }
 
 uint8_t response_buffer[5][200];
@@ -147,6 +121,7 @@ int main(void)
 {
 
   /* USER CODE BEGIN 1 */
+  dma_pool_init(); // Non-cacheable DMA buffers, mapped before the D-cache comes on
   /* USER CODE END 1 */
 
   /* Enable I-Cache-------------------------------------------------------------*/
@@ -182,62 +157,83 @@ int main(void)
   MX_SAI2_Init();
   MX_SPI2_Init();
   MX_SPI3_Init();
+  MX_RTC_Init();
 
   /* USER CODE BEGIN 2 */
   HAL_GPIO_WritePin(ESP32_SS_GPIO_Port, ESP32_SS_Pin, GPIO_PIN_RESET); // Disable ESP32 SPI listening
 
-  si468x_init(Si468x_MODE_DAB);
-
-  uint8_t *current_uuid = (uint8_t *) "9f38baeb-223d-4ed3-b4d1-b427a454487a";
-
-  uint8_t read_uuid[36];
-  //SST25_read(0, read_uuid, 36);
-
-  //if (strncmp((char *) current_uuid, (char *) read_uuid, 36)) // If flash data either not written or wrong version
-  {
-	  //SST25_sector_erase_4K(0);
-	  //SST25_write(0, current_uuid, 36);
-
+  SST25_init();
+  flash_kv_init(); // Before anything loads its settings
+  time_service_init();
+  si468x_init(&si468x_main, Si468x_MODE_DAB);
+  si468x_DAB_enable_announcements(ANNO_ALARM | ANNO_WARNING | ANNO_ROAD_TRAFFIC | ANNO_NEWS);
+  si468x_FM_AF_enable(1);
+  AR1010_init();
+  dual_tuner_enable(1); // AR1010 keeps the FM station map while the Si468x plays
+
+  uint16_t current_service_id = 0;
+  if (!si468x_DAB_load_scan_cache(&current_service_id)) // Missing, stale or written by an older firmware
 	  si468x_DAB_band_scan();
-  }
 
-  uint16_t num_services = 0, current_service_id = 0;
-  //SST25_read(4096, (uint8_t *) &num_services, 2);
+  uint16_t num_services = si468x_DAB_get_num_services();
+  service_link_build();
+  service_link_enable_fallback(1, 1); // Fall back to the linked FM station on the AR1010
   /* USER CODE END 2 */
 
   /* Infinite loop */
   /* USER CODE BEGIN WHILE */
   uint8_t text_index = 0;
+  uint32_t led_toggled = HAL_GetTick();
   while (1)
   {
-	  HAL_GPIO_TogglePin(LD2_GPIO_Port, LD2_Pin);
-	  HAL_Delay(100);
+	  if (HAL_GetTick() - led_toggled >= LED_INTERVAL)
+	  {
+		  HAL_GPIO_TogglePin(LD2_GPIO_Port, LD2_Pin);
+		  led_toggled = HAL_GetTick();
+	  }
 
-	  if (dab_change_service)
+	  if (dab_change_service && num_services)
 	  {
-		  si468x_DAB_tune_service(current_service_id++);
+		  si468x_DAB_tune_service(current_service_id);
+		  si468x_DAB_request_component_info(current_service_id, 0); // Slideshow/EPG availability, cached after the first query
+		  current_service_id++;
 		  dab_change_service = 0;
 	  }
+	  si468x_DAB_poll_component_info();
+	  si468x_DAB_update_service_stats();
+	  time_service_task();
+	  flash_kv_task(); // Erases and compaction stay out of the settings writers
 	  if (current_service_id >= num_services)
 		  current_service_id = 0;
 
-	  if (Interrupt_Status.DSRVINT)
+	  si468x_service_interrupts(&si468x_main);
+	  if (si468x_main.interrupts.DEVNTINT)
+	  {
+		  si468x_main.interrupts.DEVNTINT = 0;
+		  si468x_DAB_process_events();
+	  }
+	  if (si468x_main.interrupts.RDSINT)
+		  si468x_FM_RDS_service();
+	  si468x_FM_AF_task();
+	  dual_tuner_task();
+	  service_link_task();
+	  if (si468x_main.interrupts.DSRVINT)
 	  {
 		  uint16_t response_size = 0;
 		  si468x_DAB_get_digital_service_data(response_buffer[text_index++], &response_size, 0);
-		  Interrupt_Status.DSRVINT = 0;
+		  si468x_main.interrupts.DSRVINT = 0;
 
 		  if (text_index >= 5)
 			  text_index = 0;
 	  }
 
-//	  si468x_FM_tune(90.3); // BBC R3
-//	  si468x_FM_tune(92.52); // BBC R4
+//	  tuner_tune(&tuner_si468x_fm, FREQ_MHZ(90, 300), NULL); // BBC R3
+//	  tuner_tune(&tuner_si468x_fm, FREQ_MHZ(92, 520), NULL); // BBC R4
 //	  while (1)
-//		  si468x_FM_RDS_status();
-//	  si468x_FM_tune(96.4); // EAGLE
-//	  si468x_FM_tune(97.7); // Radio 1
-//	  si468x_FM_tune(88.1); // BBC R2
+//		  si468x_FM_RDS_service();
+//	  tuner_tune(&tuner_si468x_fm, FREQ_MHZ(96, 400), NULL); // EAGLE
+//	  tuner_tune(&tuner_si468x_fm, FREQ_MHZ(97, 700), NULL); // Radio 1
+//	  tuner_tune(&tuner_si468x_fm, FREQ_MHZ(88, 100), NULL); // BBC R2
 
   /* USER CODE END WHILE */
 
@@ -261,12 +257,19 @@ void SystemClock_Config(void)
     */
   __HAL_RCC_PWR_CLK_ENABLE();
 
+  HAL_PWR_EnableBkUpAccess();
+
+    /**Configure LSE Drive Capability 
+    */
+  __HAL_RCC_LSEDRIVE_CONFIG(RCC_LSEDRIVE_LOW);
+
   __HAL_PWR_VOLTAGESCALING_CONFIG(PWR_REGULATOR_VOLTAGE_SCALE1);
 
     /**Initializes the CPU, AHB and APB busses clocks 
     */
-  RCC_OscInitStruct.OscillatorType = RCC_OSCILLATORTYPE_HSE;
+  RCC_OscInitStruct.OscillatorType = RCC_OSCILLATORTYPE_HSE|RCC_OSCILLATORTYPE_LSE;
   RCC_OscInitStruct.HSEState = RCC_HSE_ON;
+  RCC_OscInitStruct.LSEState = RCC_LSE_ON;
   RCC_OscInitStruct.PLL.PLLState = RCC_PLL_ON;
   RCC_OscInitStruct.PLL.PLLSource = RCC_PLLSOURCE_HSE;
   RCC_OscInitStruct.PLL.PLLM = 8;
@@ -299,7 +302,9 @@ void SystemClock_Config(void)
     _Error_Handler(__FILE__, __LINE__);
   }
 
-  PeriphClkInitStruct.PeriphClockSelection = RCC_PERIPHCLK_SAI2|RCC_PERIPHCLK_I2C1;
+  PeriphClkInitStruct.PeriphClockSelection = RCC_PERIPHCLK_RTC|RCC_PERIPHCLK_SAI2
+                              |RCC_PERIPHCLK_I2C1;
+  PeriphClkInitStruct.RTCClockSelection = RCC_RTCCLKSOURCE_LSE;
   PeriphClkInitStruct.Sai2ClockSelection = RCC_SAI2CLKSOURCE_PIN;
   PeriphClkInitStruct.I2c1ClockSelection = RCC_I2C1CLKSOURCE_PCLK1;
   if (HAL_RCCEx_PeriphCLKConfig(&PeriphClkInitStruct) != HAL_OK)
@@ -0,0 +1,412 @@
+#include "rds.h"
+#include "time_service.h"
+#include <string.h>
+
+#define RDS_PI_CONFIDENCE		3 // Matching groups before a PI, or a change of PI, is accepted
+#define RDS_PTY_CONFIDENCE		2
+#define RDS_TEXT_CONFIDENCE		2 // Matching receptions of a text segment before it is shown
+#define RDS_AF_CONFIDENCE		2
+#define RDS_CONFIDENCE_MAX		8
+
+#define RDS_RT_SEGMENTS			16
+#define RDS_RT_LENGTH_B			32 // 2B groups carry 2 characters a segment
+#define RDS_RT_PLUS_AID			0x4BD7
+#define RDS_NO_GROUP			0xFF
+#define RDS_MJD_UNIX_EPOCH		40587 // MJD of 1970-01-01
+#define RDS_GROUP_DURATION		88 // ms, a group has been fully received by the time it is read
+
+#define RDS_AF_FILLER			205 // Codes from here up are fillers, list counts or the LF/MF marker
+#define RDS_AF_LF_MF			250 // The other code in the pair is an LF/MF frequency
+
+static void rds_decode_basic_tuning(const uint16_t *blocks, const uint8_t *block_errors, uint8_t version_b);
+static void rds_decode_radiotext(const uint16_t *blocks, const uint8_t *block_errors, uint8_t version_b);
+static void rds_decode_oda(const uint16_t *blocks, const uint8_t *block_errors);
+static void rds_decode_rt_plus(const uint16_t *blocks, const uint8_t *block_errors);
+static void rds_decode_clock_time(const uint16_t *blocks, const uint8_t *block_errors);
+static void rds_update_pi(uint16_t pi);
+static void rds_add_af(uint8_t code);
+static void rds_update_text(char *candidate, uint8_t *confidence, uint8_t segment, uint8_t size, const char *text);
+static void rds_clear_station();
+
+// Decoder state, only touched by rds_decode_group
+static RDS_Data working;
+static uint16_t pi_candidate;
+static uint8_t pi_confidence;
+static uint8_t pty_candidate;
+static uint8_t pty_confidence;
+static char ps_candidate[RDS_PS_LENGTH];
+static uint8_t ps_confidence[RDS_PS_LENGTH / 2];
+static char rt_candidate[RDS_RT_LENGTH];
+static uint8_t rt_confidence[RDS_RT_SEGMENTS];
+static uint8_t rt_ab_flag;
+static uint8_t rt_version_b;
+static uint8_t rt_length; // Up to the 0x0D terminator, the full length for the group version if none seen
+static Freq_kHz af_candidate[RDS_MAX_AF];
+static uint8_t af_confidence[RDS_MAX_AF];
+static uint8_t af_candidates;
+static uint8_t rt_plus_group = RDS_NO_GROUP; // Group type and version carrying RT+, from the 3A announcement
+static uint8_t dirty;
+
+// Two snapshots: the decoder fills the unpublished one, then bumps the sequence to flip them
+static RDS_Data snapshot[2];
+static volatile uint32_t snapshot_sequence = 0;
+
+void rds_reset()
+{
+	memset(&working, 0, sizeof(working));
+	pi_candidate = 0;
+	pi_confidence = 0;
+	pty_confidence = 0;
+	rt_plus_group = RDS_NO_GROUP;
+	rds_clear_station();
+	dirty = 1;
+	rds_publish();
+}
+
+void rds_clear_station()
+{
+	working.valid &= RDS_VALID_PI;
+	memset(working.ps, ' ', RDS_PS_LENGTH);
+	working.ps[RDS_PS_LENGTH] = 0;
+	memset(working.rt, 0, sizeof(working.rt));
+	memset(working.rt_plus, 0, sizeof(working.rt_plus));
+	working.num_af = 0;
+	working.ct = 0;
+
+	memset(ps_candidate, ' ', RDS_PS_LENGTH);
+	memset(ps_confidence, 0, sizeof(ps_confidence));
+	memset(rt_candidate, 0, RDS_RT_LENGTH);
+	memset(rt_confidence, 0, sizeof(rt_confidence));
+	rt_version_b = 0;
+	rt_length = RDS_RT_LENGTH;
+	af_candidates = 0;
+}
+
+void rds_decode_group(const uint16_t *blocks, const uint8_t *block_errors)
+{
+	working.groups++;
+	if (block_errors[RDS_BLOCK_B] >= RDS_BLE_UNCORRECTABLE)
+	{
+		working.dropped_groups++; // Group type unknown, nothing else in the group can be trusted
+		return;
+	}
+
+	uint8_t group_type = blocks[RDS_BLOCK_B] >> 12;
+	uint8_t version_b = (blocks[RDS_BLOCK_B] >> 11) & 0x01;
+
+	if (block_errors[RDS_BLOCK_A] <= RDS_BLE_CORRECTED_1_2)
+		rds_update_pi(blocks[RDS_BLOCK_A]);
+	else if (version_b && block_errors[RDS_BLOCK_C] <= RDS_BLE_CORRECTED_1_2)
+		rds_update_pi(blocks[RDS_BLOCK_C]); // Version B repeats PI in block C
+	if (pi_confidence < RDS_PI_CONFIDENCE)
+		return; // Hold off until the station is known, so data isn't attributed to the wrong one
+
+	uint8_t pty = (blocks[RDS_BLOCK_B] >> 5) & 0x1F;
+	if (pty == pty_candidate)
+	{
+		if (pty_confidence < RDS_CONFIDENCE_MAX)
+			pty_confidence++;
+	}
+	else
+	{
+		pty_candidate = pty;
+		pty_confidence = 1;
+	}
+	if (pty_confidence >= RDS_PTY_CONFIDENCE && (working.pty != pty || !(working.valid & RDS_VALID_PTY)))
+	{
+		working.pty = pty;
+		working.valid |= RDS_VALID_PTY;
+		dirty = 1;
+	}
+	uint8_t tp = (blocks[RDS_BLOCK_B] >> 10) & 0x01;
+	if (working.tp != tp)
+	{
+		working.tp = tp;
+		dirty = 1;
+	}
+
+	if (((group_type << 1) | version_b) == rt_plus_group)
+	{
+		rds_decode_rt_plus(blocks, block_errors);
+		return;
+	}
+
+	switch (group_type)
+	{
+	case 0:
+		rds_decode_basic_tuning(blocks, block_errors, version_b);
+		break;
+	case 2:
+		rds_decode_radiotext(blocks, block_errors, version_b);
+		break;
+	case 3:
+		if (!version_b)
+			rds_decode_oda(blocks, block_errors);
+		break;
+	case 4:
+		if (!version_b)
+			rds_decode_clock_time(blocks, block_errors);
+		break;
+	}
+}
+
+void rds_group_lost(uint16_t count)
+{
+	working.dropped_groups += count;
+}
+
+void rds_update_pi(uint16_t pi)
+{
+	if (pi == pi_candidate)
+	{
+		if (pi_confidence < RDS_CONFIDENCE_MAX)
+			pi_confidence++;
+	}
+	else
+	{
+		pi_candidate = pi;
+		pi_confidence = 1;
+	}
+
+	if (pi_confidence >= RDS_PI_CONFIDENCE && (working.pi != pi || !(working.valid & RDS_VALID_PI)))
+	{
+		if (working.valid & RDS_VALID_PI)
+			rds_clear_station(); // Different station on the same frequency
+		working.pi = pi;
+		working.valid |= RDS_VALID_PI;
+		dirty = 1;
+	}
+}
+
+void rds_decode_basic_tuning(const uint16_t *blocks, const uint8_t *block_errors, uint8_t version_b)
+{
+	uint8_t ta = (blocks[RDS_BLOCK_B] >> 4) & 0x01;
+	if (working.ta != ta)
+	{
+		working.ta = ta;
+		dirty = 1;
+	}
+
+	if (block_errors[RDS_BLOCK_D] <= RDS_BLE_CORRECTED_1_2)
+	{
+		uint8_t segment = blocks[RDS_BLOCK_B] & 0x03;
+		char text[2] = {blocks[RDS_BLOCK_D] >> 8, blocks[RDS_BLOCK_D] & 0xFF};
+		rds_update_text(ps_candidate, ps_confidence, segment, 2, text);
+
+		uint8_t complete = 1;
+		for (uint8_t i = 0; i < RDS_PS_LENGTH / 2; i++)
+		{
+			if (ps_confidence[i] >= RDS_TEXT_CONFIDENCE && memcmp(working.ps + 2 * i, ps_candidate + 2 * i, 2))
+			{
+				memcpy(working.ps + 2 * i, ps_candidate + 2 * i, 2);
+				dirty = 1;
+			}
+			complete &= ps_confidence[i] >= RDS_TEXT_CONFIDENCE;
+		}
+		if (complete && !(working.valid & RDS_VALID_PS))
+		{
+			working.valid |= RDS_VALID_PS;
+			dirty = 1;
+		}
+	}
+
+	// Method A AF list: a count code followed by frequencies, two per group
+	if (!version_b && block_errors[RDS_BLOCK_C] <= RDS_BLE_CORRECTED_1_2)
+	{
+		uint8_t af_1 = blocks[RDS_BLOCK_C] >> 8;
+		uint8_t af_2 = blocks[RDS_BLOCK_C] & 0xFF;
+		if (af_1 != RDS_AF_LF_MF)
+		{
+			rds_add_af(af_1);
+			rds_add_af(af_2);
+		}
+	}
+}
+
+void rds_add_af(uint8_t code)
+{
+	if (code == 0 || code >= RDS_AF_FILLER)
+		return;
+
+	Freq_kHz frequency = FREQ_MHZ(87, 500) + (Freq_kHz) code * 100;
+	uint8_t i;
+	for (i = 0; i < af_candidates && af_candidate[i] != frequency; i++);
+	if (i == af_candidates)
+	{
+		if (af_candidates >= RDS_MAX_AF)
+			return;
+		af_candidate[af_candidates] = frequency;
+		af_confidence[af_candidates++] = 0;
+	}
+	if (af_confidence[i] >= RDS_CONFIDENCE_MAX)
+		return;
+
+	if (++af_confidence[i] == RDS_AF_CONFIDENCE)
+	{
+		working.af[working.num_af++] = frequency;
+		working.valid |= RDS_VALID_AF;
+		dirty = 1;
+	}
+}
+
+void rds_decode_radiotext(const uint16_t *blocks, const uint8_t *block_errors, uint8_t version_b)
+{
+	uint8_t ab_flag = (blocks[RDS_BLOCK_B] >> 4) & 0x01;
+	if (ab_flag != rt_ab_flag || version_b != rt_version_b)
+	{
+		// A/B toggle: the station has started a new message. A change between 2A and 2B starts one too
+		rt_ab_flag = ab_flag;
+		rt_version_b = version_b;
+		memset(rt_candidate, 0, RDS_RT_LENGTH);
+		memset(rt_confidence, 0, sizeof(rt_confidence));
+		rt_length = version_b ? RDS_RT_LENGTH_B : RDS_RT_LENGTH;
+	}
+
+	uint8_t segment = blocks[RDS_BLOCK_B] & 0x0F;
+	char text[4];
+	uint8_t size;
+	if (version_b)
+	{
+		if (block_errors[RDS_BLOCK_D] > RDS_BLE_CORRECTED_1_2)
+			return;
+		text[0] = blocks[RDS_BLOCK_D] >> 8;
+		text[1] = blocks[RDS_BLOCK_D] & 0xFF;
+		size = 2;
+	}
+	else
+	{
+		if (block_errors[RDS_BLOCK_C] > RDS_BLE_CORRECTED_1_2 || block_errors[RDS_BLOCK_D] > RDS_BLE_CORRECTED_1_2)
+			return;
+		text[0] = blocks[RDS_BLOCK_C] >> 8;
+		text[1] = blocks[RDS_BLOCK_C] & 0xFF;
+		text[2] = blocks[RDS_BLOCK_D] >> 8;
+		text[3] = blocks[RDS_BLOCK_D] & 0xFF;
+		size = 4;
+	}
+	rds_update_text(rt_candidate, rt_confidence, segment, size, text);
+
+	for (uint8_t i = 0; i < size; i++)
+		if (text[i] == 0x0D && segment * size + i < rt_length)
+			rt_length = segment * size + i;
+
+	uint8_t segments = (rt_length + size - 1) / size;
+	if (segments > RDS_RT_SEGMENTS)
+		segments = RDS_RT_SEGMENTS;
+	for (uint8_t i = 0; i < segments; i++)
+		if (rt_confidence[i] < RDS_TEXT_CONFIDENCE)
+			return;
+
+	// Every segment of the message is confirmed
+	if (memcmp(working.rt, rt_candidate, rt_length) || working.rt[rt_length] || !(working.valid & RDS_VALID_RT))
+	{
+		memcpy(working.rt, rt_candidate, rt_length);
+		working.rt[rt_length] = 0;
+		working.valid |= RDS_VALID_RT;
+		dirty = 1;
+	}
+}
+
+void rds_update_text(char *candidate, uint8_t *confidence, uint8_t segment, uint8_t size, const char *text)
+{
+	if (!memcmp(candidate + segment * size, text, size))
+	{
+		if (confidence[segment] < RDS_CONFIDENCE_MAX)
+			confidence[segment]++;
+	}
+	else
+	{
+		memcpy(candidate + segment * size, text, size);
+		confidence[segment] = 1;
+	}
+}
+
+void rds_decode_oda(const uint16_t *blocks, const uint8_t *block_errors)
+{
+	if (block_errors[RDS_BLOCK_D] > RDS_BLE_CORRECTED_1_2)
+		return;
+
+	if (blocks[RDS_BLOCK_D] == RDS_RT_PLUS_AID)
+		rt_plus_group = blocks[RDS_BLOCK_B] & 0x1F;
+}
+
+void rds_decode_rt_plus(const uint16_t *blocks, const uint8_t *block_errors)
+{
+	if (block_errors[RDS_BLOCK_C] > RDS_BLE_CORRECTED_1_2 || block_errors[RDS_BLOCK_D] > RDS_BLE_CORRECTED_1_2)
+		return;
+
+	uint16_t b = blocks[RDS_BLOCK_B];
+	uint16_t c = blocks[RDS_BLOCK_C];
+	uint16_t d = blocks[RDS_BLOCK_D];
+	RDS_RT_Plus_Tag tags[2];
+	tags[0].content_type = ((b & 0x07) << 3) | (c >> 13);
+	tags[0].start = (c >> 7) & 0x3F;
+	tags[0].length = ((c >> 1) & 0x3F) + 1;
+	tags[1].content_type = ((c & 0x01) << 5) | (d >> 11);
+	tags[1].start = (d >> 5) & 0x3F;
+	tags[1].length = (d & 0x1F) + 1;
+
+	uint8_t running = (b >> 3) & 0x01;
+	if (memcmp(working.rt_plus, tags, sizeof(tags)) || working.rt_plus_running != running)
+	{
+		memcpy(working.rt_plus, tags, sizeof(tags));
+		working.rt_plus_running = running;
+		working.valid |= RDS_VALID_RT_PLUS;
+		dirty = 1;
+	}
+}
+
+void rds_decode_clock_time(const uint16_t *blocks, const uint8_t *block_errors)
+{
+	if (block_errors[RDS_BLOCK_B] != RDS_BLE_NONE || block_errors[RDS_BLOCK_C] != RDS_BLE_NONE || block_errors[RDS_BLOCK_D] != RDS_BLE_NONE)
+		return; // A corrected bit error would still step the clock
+
+	// MJD and UTC hour/minute, sent at the start of the minute
+	uint32_t mjd = ((uint32_t) (blocks[RDS_BLOCK_B] & 0x03) << 15) | (blocks[RDS_BLOCK_C] >> 1);
+	uint8_t hour = ((blocks[RDS_BLOCK_C] & 0x01) << 4) | (blocks[RDS_BLOCK_D] >> 12);
+	uint8_t minute = (blocks[RDS_BLOCK_D] >> 6) & 0x3F;
+	int16_t offset = (blocks[RDS_BLOCK_D] & 0x1F) * 30; // Half hours
+	if (blocks[RDS_BLOCK_D] & 0x20)
+		offset = -offset;
+
+	if (mjd < RDS_MJD_UNIX_EPOCH || hour > 23 || minute > 59)
+		return;
+
+	working.ct = (mjd - RDS_MJD_UNIX_EPOCH) * 86400 + hour * 3600 + minute * 60;
+	working.ct_local_offset = offset;
+	working.valid |= RDS_VALID_CT;
+	dirty = 1;
+
+	time_service_set_local_offset(offset);
+	time_service_reference((uint64_t) working.ct * 1000 + RDS_GROUP_DURATION, TIME_SOURCE_RDS);
+}
+
+void rds_publish()
+{
+	if (!dirty)
+		return;
+
+	RDS_Data *next = &snapshot[(snapshot_sequence + 1) & 0x01];
+	memcpy(next, &working, sizeof(RDS_Data));
+	__sync_synchronize(); // Snapshot contents before the sequence
+	snapshot_sequence++;
+	dirty = 0;
+}
+
+uint32_t rds_get_sequence()
+{
+	return snapshot_sequence;
+}
+
+uint8_t rds_get_snapshot(RDS_Data *data)
+{
+	uint32_t sequence;
+	do
+	{
+		sequence = snapshot_sequence;
+		__sync_synchronize();
+		memcpy(data, &snapshot[sequence & 0x01], sizeof(RDS_Data));
+		__sync_synchronize();
+	} while (sequence != snapshot_sequence); // Only retried if the decoder published meanwhile
+
+	return data->valid;
+}
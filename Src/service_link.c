@@ -0,0 +1,305 @@
+#include "service_link.h"
+#include <stdlib.h>
+#include "stm32f7xx_hal.h"
+#include "Si468x/Si468x.h"
+#include "Si468x/Si468x_DAB.h"
+#include "Si468x/Si468x_FM.h"
+#include "AR1010.h"
+#include "dual_tuner.h"
+#include "FM_stations.h"
+#include "rds.h"
+
+#define FALLBACK_SAMPLE_INTERVAL	500 // ms between DAB quality checks
+#define FALLBACK_BAD_SAMPLES		2 // 1 s of bad DAB before switching to FM
+#define FALLBACK_GOOD_SAMPLES		10 // 5 s of good DAB before switching back
+#define FALLBACK_FIC_QUALITY		60 // %, below this the audio is breaking up
+#define FALLBACK_FADE_STEPS			10
+#define FALLBACK_FADE_INTERVAL		50 // ms per fade step
+#define FALLBACK_DAB_RETRY			60000 // ms, the Si468x can only check DAB by rebooting into it
+#define RDS_LEARN_INTERVAL			5000 // ms
+
+static Service_Link links[SERVICE_LINK_MAX];
+static uint8_t num_links = 0;
+
+static uint8_t fallback_enabled = 0;
+static uint8_t use_ar1010 = 0;
+static uint8_t state = FALLBACK_DAB;
+static uint16_t fallback_service;
+static uint8_t bad_samples;
+static uint8_t good_samples;
+static uint32_t bad_since;
+static uint32_t return_start;
+static uint32_t last_sample;
+static uint32_t last_fade;
+static uint32_t last_rds_learn;
+static uint8_t fade_position;
+static uint8_t unlinked_outage; // Counted once per outage, not on every retry while DAB stays bad
+static uint8_t retry_pending; // Rebooted into DAB, the recovery only counts once it stays good
+static uint16_t retry_return_time;
+static Fallback_Stats stats;
+
+static uint8_t dab_quality_good();
+static void start_fallback(uint32_t tick);
+static void start_return(uint32_t tick);
+static void retry_dab(uint32_t tick);
+static void record_recovery(uint16_t return_time);
+static void fade_step(uint32_t tick);
+
+// Implicit linking (EN 300 401 8.1.15): a programme whose DAB SId equals an FM PI is the same programme
+void service_link_build()
+{
+	num_links = 0;
+	FM_Station_List *stations = malloc(sizeof(FM_Station_List));
+	uint8_t num_stations = FM_stations_load(stations);
+
+	uint16_t num_services = si468x_DAB_get_num_services();
+	for (uint16_t i = 0; i < num_services; i++)
+	{
+		uint32_t service_id = si468x_DAB_get_service_id(i);
+		if (!service_id || service_id > 0xFFFF) // Data services have 32 bit SIds
+			continue;
+
+		service_link_add(service_id, service_id, 0); // RDS can fill in the frequencies later
+		for (uint8_t j = 0; j < num_stations; j++) // Ranked, so the best frequency comes first
+		{
+			if (stations->stations[j].pi == service_id)
+				service_link_add(service_id, service_id, stations->stations[j].freq);
+		}
+	}
+	free(stations);
+}
+
+// freq 0 only creates the link. Returns 1 if anything changed
+uint8_t service_link_add(uint32_t service_id, uint16_t pi, Freq_kHz freq)
+{
+	Service_Link *link = (Service_Link *) service_link_find(service_id);
+	if (!link)
+	{
+		if (num_links >= SERVICE_LINK_MAX)
+			return 0;
+		link = &links[num_links++];
+		link->service_id = service_id;
+		link->pi = pi;
+		link->num_freqs = 0;
+		if (!freq)
+			return 1;
+	}
+	if (!freq || link->num_freqs >= SERVICE_LINK_MAX_FREQS)
+		return 0;
+	for (uint8_t i = 0; i < link->num_freqs; i++)
+	{
+		if (link->freqs[i] == freq)
+			return 0;
+	}
+	link->freqs[link->num_freqs++] = freq;
+	return 1;
+}
+
+const Service_Link *service_link_find(uint32_t service_id)
+{
+	for (uint8_t i = 0; i < num_links; i++)
+	{
+		if (links[i].service_id == service_id)
+			return &links[i];
+	}
+	return NULL;
+}
+
+// Adds the AF list of the FM station playing on the Si468x to the link with its PI
+void service_link_learn_rds()
+{
+	RDS_Data rds;
+	if ((rds_get_snapshot(&rds) & (RDS_VALID_PI | RDS_VALID_AF)) != (RDS_VALID_PI | RDS_VALID_AF))
+		return;
+	for (uint8_t i = 0; i < num_links; i++)
+	{
+		if (links[i].pi != rds.pi)
+			continue;
+		for (uint8_t j = 0; j < rds.num_af; j++)
+			service_link_add(links[i].service_id, rds.pi, rds.af[j]);
+	}
+}
+
+// With the AR1010 the Si468x stays on DAB, so it can cross-fade both ways. Without it the Si468x switches to FM mode
+void service_link_enable_fallback(uint8_t enable, uint8_t ar1010)
+{
+	fallback_enabled = enable;
+	use_ar1010 = ar1010;
+	bad_samples = 0;
+	good_samples = 0;
+	unlinked_outage = 0;
+	retry_pending = 0;
+}
+
+void service_link_task()
+{
+	if (!fallback_enabled)
+		return;
+
+	uint32_t tick = HAL_GetTick();
+	switch (state)
+	{
+	case FALLBACK_FADE_TO_FM:
+	case FALLBACK_FADE_TO_DAB:
+		fade_step(tick);
+		return;
+	case FALLBACK_SI468X_FM:
+		if (tick - last_rds_learn >= RDS_LEARN_INTERVAL)
+		{
+			last_rds_learn = tick;
+			service_link_learn_rds();
+		}
+		if (tick - bad_since >= FALLBACK_DAB_RETRY)
+			retry_dab(tick);
+		return;
+	default:
+		break;
+	}
+
+	if (tick - last_sample < FALLBACK_SAMPLE_INTERVAL)
+		return;
+	last_sample = tick;
+	if (si468x_DAB_get_current_service() >= si468x_DAB_get_num_services())
+		return; // Nothing playing
+
+	if (dab_quality_good())
+	{
+		bad_samples = 0;
+		unlinked_outage = 0;
+		if (state == FALLBACK_DAB && retry_pending && ++good_samples >= FALLBACK_GOOD_SAMPLES)
+		{
+			retry_pending = 0;
+			good_samples = 0;
+			record_recovery(retry_return_time);
+		}
+		if (state != FALLBACK_AR1010_FM)
+			return;
+		if (++good_samples >= FALLBACK_GOOD_SAMPLES)
+			start_return(tick);
+		return;
+	}
+
+	good_samples = 0;
+	if (state != FALLBACK_DAB)
+		return;
+	if (bad_samples++ == 0)
+		bad_since = tick;
+	if (bad_samples >= FALLBACK_BAD_SAMPLES)
+		start_fallback(tick);
+}
+
+uint8_t service_link_get_state()
+{
+	return state;
+}
+
+void service_link_get_stats(Fallback_Stats *out)
+{
+	*out = stats;
+}
+
+uint8_t dab_quality_good()
+{
+	DAB_DigRad_Status status;
+	si468x_DAB_get_digrad_status(&status);
+	return status.VALID && !status.HARDMUTE && status.fic_quality >= FALLBACK_FIC_QUALITY;
+}
+
+void start_fallback(uint32_t tick)
+{
+	bad_samples = 0;
+	retry_pending = 0; // DAB failed again after a retry, that was no recovery
+	fallback_service = si468x_DAB_get_current_service();
+	const Service_Link *link = service_link_find(si468x_DAB_get_service_id(fallback_service));
+	if (!link || !link->num_freqs)
+	{
+		if (!unlinked_outage)
+			stats.unlinked++;
+		unlinked_outage = 1;
+		return;
+	}
+
+	Freq_kHz freq = 0;
+	if (use_ar1010 && dual_tuner_valid())
+		freq = dual_tuner_strongest(link->freqs, link->num_freqs); // Whichever the AR1010 hears best right now
+	if (!freq)
+		freq = link->freqs[0];
+	stats.fallbacks++;
+
+	if (!use_ar1010)
+	{
+		si468x_init(si468x_device, Si468x_MODE_FM);
+		si468x_FM_tune(freq);
+		state = FALLBACK_SI468X_FM;
+		stats.last_switch_time = HAL_GetTick() - bad_since;
+		if (stats.last_switch_time > stats.max_switch_time)
+			stats.max_switch_time = stats.last_switch_time;
+		return;
+	}
+
+	AR1010_set_volume(0);
+	dual_tuner_enable(0); // Stops the background sweep and unmutes the AR1010
+	AR1010_tune(freq);
+	fade_position = 0;
+	last_fade = tick;
+	state = FALLBACK_FADE_TO_FM;
+}
+
+void start_return(uint32_t tick)
+{
+	good_samples = 0;
+	return_start = tick;
+	si468x_set_mute(si468x_device, 0);
+	fade_position = 0;
+	last_fade = tick;
+	state = FALLBACK_FADE_TO_DAB;
+}
+
+// Reboots into DAB, if it is still bad the next samples fall straight back to FM. The reboot time is only
+// recorded once DAB has stayed good for FALLBACK_GOOD_SAMPLES
+void retry_dab(uint32_t tick)
+{
+	si468x_init(si468x_device, Si468x_MODE_DAB);
+	si468x_DAB_tune_service(fallback_service);
+	state = FALLBACK_DAB;
+	bad_samples = 0;
+	good_samples = 0;
+	retry_pending = 1;
+	retry_return_time = HAL_GetTick() - tick;
+}
+
+void record_recovery(uint16_t return_time)
+{
+	stats.recoveries++;
+	stats.last_return_time = return_time;
+	if (stats.last_return_time > stats.max_return_time)
+		stats.max_return_time = stats.last_return_time;
+}
+
+void fade_step(uint32_t tick)
+{
+	if (tick - last_fade < FALLBACK_FADE_INTERVAL)
+		return;
+	last_fade = tick;
+
+	fade_position++;
+	uint8_t fm_level = state == FALLBACK_FADE_TO_FM ? fade_position : FALLBACK_FADE_STEPS - fade_position;
+	si468x_set_volume(si468x_device, SI468X_MAX_VOLUME * (FALLBACK_FADE_STEPS - fm_level) / FALLBACK_FADE_STEPS);
+	AR1010_set_volume(AR1010_MAX_VOLUME * fm_level / FALLBACK_FADE_STEPS);
+	if (fade_position < FALLBACK_FADE_STEPS)
+		return;
+
+	if (state == FALLBACK_FADE_TO_FM)
+	{
+		si468x_set_mute(si468x_device, 1); // Also silences the I2S output, the volume only covers the DAC
+		state = FALLBACK_AR1010_FM;
+		stats.last_switch_time = HAL_GetTick() - bad_since;
+		if (stats.last_switch_time > stats.max_switch_time)
+			stats.max_switch_time = stats.last_switch_time;
+		return;
+	}
+
+	dual_tuner_enable(1);
+	state = FALLBACK_DAB;
+	record_recovery(HAL_GetTick() - return_start);
+}
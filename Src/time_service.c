@@ -0,0 +1,304 @@
+#include "time_service.h"
+#include "rtc.h"
+#include "Si468x/Si468x.h"
+#include "Si468x/Si468x_DAB.h"
+
+#define TIME_BACKUP_MAGIC			0x54494D45 // "TIME" in RTC_BKP_DR0 while the calendar holds UTC
+#define TIME_BACKUP_CALIBRATION		RTC_BKP_DR1
+#define TIME_BACKUP_LOCAL_OFFSET	RTC_BKP_DR2
+
+#define TIME_SYNC_INTERVAL_MIN		60000 // ms
+#define TIME_SYNC_INTERVAL_MAX		21600000 // 6 h once the drift is trimmed out
+#define TIME_SYNC_RETRY				10000 // No ensemble time yet
+#define TIME_STEP_THRESHOLD			250 // ms, smaller errors are left to the calibration
+#define TIME_RESET_THRESHOLD		3600000 // ms, anything further out is a new reference rather than drift
+#define TIME_DRIFT_WINDOW			86400000 // ms of reference time before the calibration is trimmed
+#define TIME_DAB_POLL				50 // ms between GET_TIME queries while waiting for the seconds to roll over
+#define TIME_DAB_EDGE_POLLS			40
+
+#define RTC_SYNCH_PREDIV			255
+#define RTC_CALIBRATION_MAX			511 // Pulses per 2^20 RTC clocks, 0.954 ppm each
+#define RTC_CALIBRATION_MIN			-511
+
+static void time_service_set_rtc(uint64_t utc_ms);
+static void time_service_apply_calibration();
+static void date_from_days(uint32_t days, uint16_t *year, uint8_t *month, uint8_t *day);
+
+static uint8_t time_valid = 0;
+static uint8_t time_source = TIME_SOURCE_NONE;
+static int16_t local_offset = 0; // Minutes east of UTC
+static int16_t calibration = 0; // Positive speeds the RTC up
+
+static uint32_t next_sync_tick = 0;
+static uint32_t sync_interval = TIME_SYNC_INTERVAL_MIN;
+
+// Drift window: the RTC error is measured against the error when the window opened, plus every step applied since
+static uint64_t window_start = 0;
+static int32_t window_base_error = 0;
+static int32_t window_steps = 0;
+
+static uint8_t dab_edge_second = 0xFF; // Seconds reported by the first query of a sync, 0xFF when idle
+static uint8_t dab_edge_polls = 0;
+static uint32_t dab_last_poll = 0;
+
+void time_service_init()
+{
+	if (HAL_RTCEx_BKUPRead(&hrtc, RTC_BKP_DR0) == TIME_BACKUP_MAGIC)
+	{
+		time_valid = 1;
+		calibration = (int16_t) HAL_RTCEx_BKUPRead(&hrtc, TIME_BACKUP_CALIBRATION);
+		local_offset = (int16_t) HAL_RTCEx_BKUPRead(&hrtc, TIME_BACKUP_LOCAL_OFFSET);
+	}
+	else
+	{
+		time_valid = 0;
+		calibration = 0;
+		local_offset = 0;
+	}
+	time_source = TIME_SOURCE_NONE;
+	time_service_apply_calibration();
+
+	sync_interval = TIME_SYNC_INTERVAL_MIN;
+	next_sync_tick = HAL_GetTick();
+	window_start = 0;
+}
+
+// Polls DAB time when a sync is due. On FM the references arrive from RDS CT instead.
+void time_service_task()
+{
+	if (si468x_device->mode != Si468x_MODE_DAB || !time_service_sync_due())
+		return;
+
+	uint32_t tick = HAL_GetTick();
+	if (dab_edge_second != 0xFF && tick - dab_last_poll < TIME_DAB_POLL)
+		return;
+	dab_last_poll = tick;
+
+	DAB_Time time = si468x_DAB_get_time(1);
+	if (time.year < 2000 || time.month == 0 || time.month > 12 || time.day == 0)
+	{
+		dab_edge_second = 0xFF;
+		next_sync_tick = tick + TIME_SYNC_RETRY;
+		return;
+	}
+
+	// The reply only carries whole seconds, so wait for them to roll over to find the edge
+	if (dab_edge_second == 0xFF)
+	{
+		dab_edge_second = time.second;
+		dab_edge_polls = 0;
+		return;
+	}
+	if (time.second == dab_edge_second)
+	{
+		if (++dab_edge_polls >= TIME_DAB_EDGE_POLLS)
+		{
+			dab_edge_second = 0xFF;
+			next_sync_tick = tick + TIME_SYNC_RETRY;
+		}
+		return;
+	}
+	dab_edge_second = 0xFF;
+
+	uint32_t days = time_service_days_from_date(time.year, time.month, time.day);
+	uint64_t utc_ms = ((uint64_t) days * 86400 + time.hour * 3600 + time.minute * 60 + time.second) * 1000;
+	time_service_reference(utc_ms + TIME_DAB_POLL / 2, TIME_SOURCE_DAB);
+}
+
+uint8_t time_service_sync_due()
+{
+	return (int32_t) (HAL_GetTick() - next_sync_tick) >= 0;
+}
+
+void time_service_reference(uint64_t utc_ms, uint8_t source)
+{
+	if (!time_service_sync_due())
+		return;
+
+	uint32_t tick = HAL_GetTick();
+	int64_t error = (int64_t) (time_service_now_ms() - utc_ms);
+
+	if (!time_valid || error > TIME_RESET_THRESHOLD || error < -TIME_RESET_THRESHOLD)
+	{
+		time_service_set_rtc(utc_ms);
+		HAL_RTCEx_BKUPWrite(&hrtc, RTC_BKP_DR0, TIME_BACKUP_MAGIC);
+		time_valid = 1;
+		time_source = source;
+
+		window_start = utc_ms;
+		window_base_error = 0;
+		window_steps = 0;
+		sync_interval = TIME_SYNC_INTERVAL_MIN;
+		next_sync_tick = tick + sync_interval;
+		return;
+	}
+	time_source = source;
+
+	// First reference since boot on a calendar kept by VBAT
+	if (window_start == 0)
+	{
+		window_start = utc_ms;
+		window_base_error = error;
+		window_steps = 0;
+	}
+
+	uint64_t elapsed = utc_ms - window_start;
+	if (elapsed >= TIME_DRIFT_WINDOW)
+	{
+		int32_t drift = window_steps + error - window_base_error; // ms gained over the window
+		int32_t pulses = -(int64_t) drift * 1048576 / (int64_t) elapsed;
+		int32_t trimmed = calibration + pulses;
+		if (trimmed > RTC_CALIBRATION_MAX)
+			trimmed = RTC_CALIBRATION_MAX;
+		else if (trimmed < RTC_CALIBRATION_MIN)
+			trimmed = RTC_CALIBRATION_MIN;
+		calibration = trimmed;
+		time_service_apply_calibration();
+
+		window_start = utc_ms;
+		window_base_error = error;
+		window_steps = 0;
+	}
+
+	if (error >= TIME_STEP_THRESHOLD || error <= -TIME_STEP_THRESHOLD)
+	{
+		time_service_set_rtc(utc_ms);
+		window_steps += error;
+		sync_interval /= 2;
+		if (sync_interval < TIME_SYNC_INTERVAL_MIN)
+			sync_interval = TIME_SYNC_INTERVAL_MIN;
+	}
+	else
+	{
+		sync_interval *= 2;
+		if (sync_interval > TIME_SYNC_INTERVAL_MAX)
+			sync_interval = TIME_SYNC_INTERVAL_MAX;
+	}
+	next_sync_tick = tick + sync_interval;
+}
+
+void time_service_set_local_offset(int16_t minutes)
+{
+	if (minutes == local_offset)
+		return;
+	local_offset = minutes;
+	HAL_RTCEx_BKUPWrite(&hrtc, TIME_BACKUP_LOCAL_OFFSET, (uint16_t) minutes);
+}
+
+uint8_t time_service_is_valid()
+{
+	return time_valid;
+}
+
+uint8_t time_service_get_source()
+{
+	return time_source;
+}
+
+uint32_t time_service_now()
+{
+	return time_service_now_ms() / 1000;
+}
+
+uint64_t time_service_now_ms()
+{
+	RTC_TimeTypeDef rtc_time;
+	RTC_DateTypeDef rtc_date;
+	// Reading the time locks the shadow registers until the date is read, an interrupt reading in between would
+	// unlock them early or get a torn time and date
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	HAL_RTC_GetTime(&hrtc, &rtc_time, RTC_FORMAT_BIN);
+	HAL_RTC_GetDate(&hrtc, &rtc_date, RTC_FORMAT_BIN); // Unlocks the shadow registers, must follow GetTime
+	__set_PRIMASK(primask);
+
+	uint32_t days = time_service_days_from_date(2000 + rtc_date.Year, rtc_date.Month, rtc_date.Date);
+	uint32_t seconds = rtc_time.Hours * 3600 + rtc_time.Minutes * 60 + rtc_time.Seconds;
+	uint32_t millisecond = (rtc_time.SecondFraction - rtc_time.SubSeconds) * 1000 / (rtc_time.SecondFraction + 1);
+	return ((uint64_t) days * 86400 + seconds) * 1000 + millisecond;
+}
+
+void time_service_get_date(Time_Date *date, uint8_t local)
+{
+	uint64_t ms = time_service_now_ms();
+	if (local)
+		ms += (int64_t) local_offset * 60000;
+
+	uint32_t seconds = ms / 1000;
+	date_from_days(seconds / 86400, &date->year, &date->month, &date->day);
+	seconds %= 86400;
+	date->hour = seconds / 3600;
+	date->minute = (seconds / 60) % 60;
+	date->second = seconds % 60;
+	date->millisecond = ms % 1000;
+}
+
+float time_service_get_drift_ppm()
+{
+	return -calibration * 1000000.0f / 1048576;
+}
+
+// Days since 1970-01-01 in the proleptic Gregorian calendar
+uint32_t time_service_days_from_date(uint16_t year, uint8_t month, uint8_t day)
+{
+	if (month <= 2)
+		year--;
+	uint32_t era = year / 400;
+	uint32_t year_of_era = year - era * 400;
+	uint32_t day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+	uint32_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+	return era * 146097 + day_of_era - 719468;
+}
+
+static void date_from_days(uint32_t days, uint16_t *year, uint8_t *month, uint8_t *day)
+{
+	days += 719468;
+	uint32_t era = days / 146097;
+	uint32_t day_of_era = days - era * 146097;
+	uint32_t year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+	uint32_t day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+	uint32_t mp = (5 * day_of_year + 2) / 153;
+	*day = day_of_year - (153 * mp + 2) / 5 + 1;
+	*month = mp < 10 ? mp + 3 : mp - 9;
+	*year = year_of_era + era * 400 + (*month <= 2);
+}
+
+static void time_service_set_rtc(uint64_t utc_ms)
+{
+	// The calendar restarts at a whole second, so set the next one and delay it by the remainder
+	uint32_t fraction = utc_ms % 1000;
+	uint32_t seconds = utc_ms / 1000 + (fraction ? 1 : 0);
+
+	RTC_DateTypeDef rtc_date;
+	uint16_t year;
+	uint8_t month, day;
+	date_from_days(seconds / 86400, &year, &month, &day);
+	rtc_date.Year = year - 2000;
+	rtc_date.Month = month;
+	rtc_date.Date = day;
+	rtc_date.WeekDay = (seconds / 86400 + 3) % 7 + 1; // 1970-01-01 was a Thursday, RTC counts Monday as 1
+
+	RTC_TimeTypeDef rtc_time = {0};
+	seconds %= 86400;
+	rtc_time.Hours = seconds / 3600;
+	rtc_time.Minutes = (seconds / 60) % 60;
+	rtc_time.Seconds = seconds % 60;
+	rtc_time.TimeFormat = RTC_HOURFORMAT12_AM;
+	rtc_time.DayLightSaving = RTC_DAYLIGHTSAVING_NONE;
+	rtc_time.StoreOperation = RTC_STOREOPERATION_RESET;
+
+	HAL_RTC_SetTime(&hrtc, &rtc_time, RTC_FORMAT_BIN);
+	HAL_RTC_SetDate(&hrtc, &rtc_date, RTC_FORMAT_BIN);
+	if (fraction)
+		HAL_RTCEx_SetSynchroShift(&hrtc, RTC_SHIFTADD1S_RESET, (1000 - fraction) * (RTC_SYNCH_PREDIV + 1) / 1000);
+}
+
+static void time_service_apply_calibration()
+{
+	// CALP adds 512 pulses, CALM removes up to 511
+	if (calibration > 0)
+		HAL_RTCEx_SetSmoothCalib(&hrtc, RTC_SMOOTHCALIB_PERIOD_32SEC, RTC_SMOOTHCALIB_PLUSPULSES_SET, 512 - calibration);
+	else
+		HAL_RTCEx_SetSmoothCalib(&hrtc, RTC_SMOOTHCALIB_PERIOD_32SEC, RTC_SMOOTHCALIB_PLUSPULSES_RESET, -calibration);
+	HAL_RTCEx_BKUPWrite(&hrtc, TIME_BACKUP_CALIBRATION, (uint16_t) calibration);
+}
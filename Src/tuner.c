@@ -0,0 +1,80 @@
+#include "tuner.h"
+#include <string.h>
+
+// The operation is marked busy before the backend runs, so a synchronous backend can complete it from inside the call
+uint8_t tuner_tune(Tuner *tuner, Freq_kHz freq, Tuner_Callback callback)
+{
+	if (tuner->busy)
+		return TUNER_BUSY;
+	if (freq < tuner->bottom || freq > tuner->top)
+		return TUNER_OUT_OF_BAND;
+
+	tuner->busy = 1;
+	tuner->callback = callback;
+	uint8_t status = tuner->ops->tune(tuner, freq);
+	if (status != TUNER_OK)
+		tuner->busy = 0;
+	return status;
+}
+
+uint8_t tuner_seek(Tuner *tuner, uint8_t up, Tuner_Callback callback)
+{
+	if (!(tuner->capabilities & TUNER_CAP_SEEK))
+		return TUNER_UNSUPPORTED;
+	if (tuner->busy)
+		return TUNER_BUSY;
+
+	tuner->busy = 1;
+	tuner->callback = callback;
+	uint8_t status = tuner->ops->seek(tuner, up);
+	if (status != TUNER_OK)
+		tuner->busy = 0;
+	return status;
+}
+
+// Always blocking, scans run in the foreground of whoever asked
+uint8_t tuner_scan(Tuner *tuner, FM_Station_List *list)
+{
+	list->size = 0;
+	list->scan_time = 0;
+	if (!(tuner->capabilities & TUNER_CAP_SCAN))
+		return TUNER_UNSUPPORTED;
+	if (tuner->busy)
+		return TUNER_BUSY;
+	return tuner->ops->scan(tuner, list);
+}
+
+uint8_t tuner_get_quality(Tuner *tuner, Tuner_Quality *quality)
+{
+	memset(quality, 0, sizeof(Tuner_Quality));
+	if (tuner->busy)
+		return TUNER_BUSY;
+	return tuner->ops->get_quality(tuner, quality);
+}
+
+uint8_t tuner_get_metadata(Tuner *tuner, Tuner_Metadata *metadata)
+{
+	memset(metadata, 0, sizeof(Tuner_Metadata));
+	if (!(tuner->capabilities & TUNER_CAP_METADATA))
+		return TUNER_UNSUPPORTED;
+	return tuner->ops->get_metadata(tuner, metadata);
+}
+
+void tuner_task(Tuner *tuner)
+{
+	if (tuner->ops->task)
+		tuner->ops->task(tuner);
+}
+
+uint8_t tuner_busy(Tuner *tuner)
+{
+	return tuner->busy;
+}
+
+void tuner_complete(Tuner *tuner, const Tuner_Result *result)
+{
+	tuner->result = *result;
+	tuner->busy = 0;
+	if (tuner->callback)
+		tuner->callback(tuner, result);
+}
@@ -0,0 +1,59 @@
+#include "tuner.h"
+#include "AR1010.h"
+
+#define AR1010_MAX_RSSI 127 // 7 bit field
+
+static uint8_t ar1010_tune(Tuner *tuner, Freq_kHz freq);
+static uint8_t ar1010_seek(Tuner *tuner, uint8_t up);
+static uint8_t ar1010_scan(Tuner *tuner, FM_Station_List *list);
+static uint8_t ar1010_get_quality(Tuner *tuner, Tuner_Quality *quality);
+static void ar1010_task(Tuner *tuner);
+static void on_complete(const AR1010_Result *result);
+
+static const Tuner_Ops ar1010_ops = {ar1010_tune, ar1010_seek, ar1010_scan, ar1010_get_quality, NULL, ar1010_task};
+
+// Only seeks up, and has no RDS decoder
+Tuner tuner_ar1010 = {"AR1010", TUNER_CAP_SEEK | TUNER_CAP_SCAN | TUNER_CAP_ASYNC, FM_EUROPE_BOTTOM, FM_EUROPE_TOP, &ar1010_ops};
+
+uint8_t ar1010_tune(Tuner *tuner, Freq_kHz freq)
+{
+	return AR1010_tune_async(freq, on_complete) ? TUNER_BUSY : TUNER_OK;
+}
+
+uint8_t ar1010_seek(Tuner *tuner, uint8_t up)
+{
+	if (!up)
+		return TUNER_UNSUPPORTED;
+	return AR1010_seek_async(on_complete) ? TUNER_BUSY : TUNER_OK;
+}
+
+uint8_t ar1010_scan(Tuner *tuner, FM_Station_List *list)
+{
+	AR1010_scan(tuner->bottom, tuner->top, list);
+	return TUNER_OK;
+}
+
+// The AR1010 only measures during a tune, so this is the last result
+uint8_t ar1010_get_quality(Tuner *tuner, Tuner_Quality *quality)
+{
+	*quality = tuner->result.quality;
+	return TUNER_OK;
+}
+
+void ar1010_task(Tuner *tuner)
+{
+	AR1010_task();
+}
+
+void on_complete(const AR1010_Result *result)
+{
+	Tuner_Result tuner_result;
+	tuner_result.status = result->success ? TUNER_OK : TUNER_FAILED;
+	tuner_result.freq = result->freq;
+	tuner_result.quality.valid = result->success;
+	tuner_result.quality.rssi = result->rssi;
+	tuner_result.quality.snr = 0;
+	tuner_result.quality.quality = result->rssi * 100 / AR1010_MAX_RSSI;
+	tuner_result.quality.stereo = result->stereo;
+	tuner_complete(&tuner_ar1010, &tuner_result);
+}
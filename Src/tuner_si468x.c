@@ -0,0 +1,187 @@
+#include "tuner.h"
+#include <string.h>
+#include "Si468x/Si468x.h"
+#include "Si468x/Si468x_DAB.h"
+#include "Si468x/Si468x_FM.h"
+#include "rds.h"
+
+#define DAB_BAND_III_BOTTOM		FREQ_MHZ(174, 0)
+#define DAB_BAND_III_TOP		FREQ_MHZ(240, 0)
+#define FM_SNR_FULL_QUALITY		40 // dB, quality 100 at or above this
+
+static uint8_t dab_tune(Tuner *tuner, Freq_kHz freq);
+static uint8_t dab_seek(Tuner *tuner, uint8_t up);
+static uint8_t dab_scan(Tuner *tuner, FM_Station_List *list);
+static uint8_t dab_get_quality(Tuner *tuner, Tuner_Quality *quality);
+static uint8_t dab_get_metadata(Tuner *tuner, Tuner_Metadata *metadata);
+static uint8_t fm_tune(Tuner *tuner, Freq_kHz freq);
+static uint8_t fm_seek(Tuner *tuner, uint8_t up);
+static uint8_t fm_scan(Tuner *tuner, FM_Station_List *list);
+static uint8_t fm_get_quality(Tuner *tuner, Tuner_Quality *quality);
+static uint8_t fm_get_metadata(Tuner *tuner, Tuner_Metadata *metadata);
+static void select_mode(enum Si468x_MODE mode);
+static void complete(Tuner *tuner, Freq_kHz freq);
+
+static const Tuner_Ops dab_ops = {dab_tune, dab_seek, dab_scan, dab_get_quality, dab_get_metadata, NULL};
+static const Tuner_Ops fm_ops = {fm_tune, fm_seek, fm_scan, fm_get_quality, fm_get_metadata, NULL};
+
+// The Si468x runs one firmware at a time, using either tuner reboots the chip into its mode
+Tuner tuner_si468x_dab = {"Si468x DAB", TUNER_CAP_SEEK | TUNER_CAP_SCAN | TUNER_CAP_METADATA, DAB_BAND_III_BOTTOM, DAB_BAND_III_TOP, &dab_ops};
+Tuner tuner_si468x_fm = {"Si468x FM", TUNER_CAP_SEEK | TUNER_CAP_SCAN | TUNER_CAP_METADATA, FM_JAPAN_BOTTOM, FM_EUROPE_TOP, &fm_ops};
+
+static uint8_t dab_freq_index = 0;
+
+// DAB tunes ensembles, freq has to be in the current frequency plan
+uint8_t dab_tune(Tuner *tuner, Freq_kHz freq)
+{
+	select_mode(Si468x_MODE_DAB);
+	const DAB_Freq_Plan *plan = si468x_DAB_get_freq_plan();
+	for (uint8_t i = 0; i < plan->size; i++)
+	{
+		if (plan->frequencies[i] != freq)
+			continue;
+		dab_freq_index = i;
+		si468x_DAB_tune(i);
+		complete(tuner, freq);
+		return TUNER_OK;
+	}
+	return TUNER_OUT_OF_BAND;
+}
+
+// Steps through the plan to the next frequency carrying an ensemble
+uint8_t dab_seek(Tuner *tuner, uint8_t up)
+{
+	select_mode(Si468x_MODE_DAB);
+	const DAB_Freq_Plan *plan = si468x_DAB_get_freq_plan();
+	if (!plan->size)
+		return TUNER_FAILED;
+
+	uint8_t index = dab_freq_index;
+	for (uint8_t i = 0; i < plan->size; i++)
+	{
+		index = up ? (index + 1) % plan->size : (index + plan->size - 1) % plan->size;
+		si468x_DAB_tune(index);
+		Tuner_Quality quality;
+		dab_get_quality(tuner, &quality);
+		if (!quality.valid)
+			continue;
+		dab_freq_index = index;
+		complete(tuner, plan->frequencies[index]);
+		return TUNER_OK;
+	}
+	si468x_DAB_tune(dab_freq_index);
+	return TUNER_FAILED;
+}
+
+// Refreshes the service list, the learned plan then only holds channels with an ensemble
+uint8_t dab_scan(Tuner *tuner, FM_Station_List *list)
+{
+	select_mode(Si468x_MODE_DAB);
+	si468x_DAB_band_scan();
+	const DAB_Freq_Plan *plan = si468x_DAB_get_freq_plan();
+	if (!plan->learned)
+		return TUNER_FAILED;
+
+	for (uint8_t i = 0; i < plan->size && list->size < FM_MAX_STATIONS; i++)
+	{
+		FM_Station *station = &list->stations[list->size++];
+		memset(station, 0, sizeof(FM_Station));
+		station->freq = plan->frequencies[i];
+	}
+	return TUNER_OK;
+}
+
+uint8_t dab_get_quality(Tuner *tuner, Tuner_Quality *quality)
+{
+	if (si468x_device->mode != Si468x_MODE_DAB)
+		return TUNER_FAILED;
+
+	DAB_DigRad_Status status;
+	si468x_DAB_get_digrad_status(&status);
+	quality->valid = status.VALID && !status.HARDMUTE;
+	quality->rssi = status.rssi;
+	quality->snr = status.snr;
+	quality->quality = status.fic_quality;
+	quality->stereo = 0;
+	return TUNER_OK;
+}
+
+uint8_t dab_get_metadata(Tuner *tuner, Tuner_Metadata *metadata)
+{
+	if (si468x_device->mode != Si468x_MODE_DAB)
+		return TUNER_FAILED;
+
+	metadata->id = si468x_DAB_get_service_id(si468x_DAB_get_current_service());
+	return metadata->id ? TUNER_OK : TUNER_FAILED;
+}
+
+uint8_t fm_tune(Tuner *tuner, Freq_kHz freq)
+{
+	select_mode(Si468x_MODE_FM);
+	si468x_FM_tune(freq);
+	complete(tuner, freq);
+	return TUNER_OK;
+}
+
+uint8_t fm_seek(Tuner *tuner, uint8_t up)
+{
+	select_mode(Si468x_MODE_FM);
+	Freq_kHz freq = si468x_FM_seek(up, 1);
+	if (!freq)
+		return TUNER_FAILED;
+	complete(tuner, freq);
+	return TUNER_OK;
+}
+
+uint8_t fm_scan(Tuner *tuner, FM_Station_List *list)
+{
+	select_mode(Si468x_MODE_FM);
+	si468x_FM_band_scan(list);
+	return TUNER_OK;
+}
+
+uint8_t fm_get_quality(Tuner *tuner, Tuner_Quality *quality)
+{
+	if (si468x_device->mode != Si468x_MODE_FM)
+		return TUNER_FAILED;
+
+	FM_RSQ_Status status;
+	si468x_FM_get_rsq_status(&status);
+	quality->valid = status.valid;
+	quality->rssi = status.rssi;
+	quality->snr = status.snr;
+	int8_t snr = status.snr < 0 ? 0 : (status.snr > FM_SNR_FULL_QUALITY ? FM_SNR_FULL_QUALITY : status.snr);
+	quality->quality = snr * 100 / FM_SNR_FULL_QUALITY;
+	quality->stereo = 0; // Not reported by FM_RSQ_STATUS
+	return TUNER_OK;
+}
+
+uint8_t fm_get_metadata(Tuner *tuner, Tuner_Metadata *metadata)
+{
+	RDS_Data rds;
+	uint8_t valid = rds_get_snapshot(&rds);
+	if (!(valid & RDS_VALID_PI))
+		return TUNER_FAILED;
+
+	metadata->id = rds.pi;
+	if (valid & RDS_VALID_PS)
+		memcpy(metadata->name, rds.ps, sizeof(rds.ps));
+	if (valid & RDS_VALID_RT)
+		memcpy(metadata->text, rds.rt, sizeof(rds.rt));
+	return TUNER_OK;
+}
+
+void select_mode(enum Si468x_MODE mode)
+{
+	if (si468x_device->mode != mode)
+		si468x_init(si468x_device, mode);
+}
+
+void complete(Tuner *tuner, Freq_kHz freq)
+{
+	Tuner_Result result;
+	result.status = TUNER_OK;
+	result.freq = freq;
+	tuner->ops->get_quality(tuner, &result.quality);
+	tuner_complete(tuner, &result);
+}
@@ -0,0 +1,147 @@
+#include "tuner.h"
+#include <string.h>
+
+// A fixed band of stations, for running schedulers and scan engines on a host or without an antenna
+
+#define SIM_TUNE_TASKS		3 // tuner_task calls before a tune completes, so callers see the async path
+#define SIM_NOISE_RSSI		8 // dBuV off station
+#define SIM_SEEK_RSSI		20 // Seek and scan stop at or above this
+#define SIM_ADJACENT_LOSS	20 // dB lost 100 kHz off the carrier
+
+typedef struct
+{
+	Freq_kHz freq;
+	int8_t rssi;
+	int8_t snr;
+	uint16_t pi;
+	const char *ps;
+} Sim_Station;
+
+static const Sim_Station sim_stations[] = {
+		{FREQ_MHZ(88, 100), 45, 30, 0xC202, "BBC R2  "},
+		{FREQ_MHZ(90, 300), 52, 35, 0xC203, "BBC R3  "},
+		{FREQ_MHZ(92, 500), 48, 32, 0xC204, "BBC R4  "},
+		{FREQ_MHZ(96, 400), 30, 15, 0xC8D1, "EAGLE   "},
+		{FREQ_MHZ(97, 700), 60, 40, 0xC201, "RADIO 1 "},
+		{FREQ_MHZ(101, 900), 25, 10, 0xC479, "CLASSIC "},
+		{FREQ_MHZ(105, 400), 15, 4, 0x0000, NULL} // Below the seek threshold, no RDS
+};
+#define NUM_SIM_STATIONS (sizeof(sim_stations) / sizeof(Sim_Station))
+
+static uint8_t sim_tune(Tuner *tuner, Freq_kHz freq);
+static uint8_t sim_seek(Tuner *tuner, uint8_t up);
+static uint8_t sim_scan(Tuner *tuner, FM_Station_List *list);
+static uint8_t sim_get_quality(Tuner *tuner, Tuner_Quality *quality);
+static uint8_t sim_get_metadata(Tuner *tuner, Tuner_Metadata *metadata);
+static void sim_task(Tuner *tuner);
+static const Sim_Station *station_at(Freq_kHz freq, int8_t *rssi);
+
+static const Tuner_Ops sim_ops = {sim_tune, sim_seek, sim_scan, sim_get_quality, sim_get_metadata, sim_task};
+
+Tuner tuner_sim = {"Simulated FM", TUNER_CAP_SEEK | TUNER_CAP_SCAN | TUNER_CAP_METADATA | TUNER_CAP_ASYNC, FM_EUROPE_BOTTOM, FM_EUROPE_TOP, &sim_ops};
+
+static Freq_kHz tuned_freq = FM_EUROPE_BOTTOM;
+static Freq_kHz pending_freq = 0;
+static uint8_t pending_tasks = 0;
+
+uint8_t sim_tune(Tuner *tuner, Freq_kHz freq)
+{
+	pending_freq = freq_snap(BAND_FM_EUROPE, freq);
+	pending_tasks = SIM_TUNE_TASKS;
+	return TUNER_OK;
+}
+
+// Wraps around the band like the chip seeks
+uint8_t sim_seek(Tuner *tuner, uint8_t up)
+{
+	const Freq_Raster *raster = &freq_rasters[BAND_FM_EUROPE];
+	Freq_kHz freq = tuned_freq;
+	for (uint16_t i = 0; i < raster->channels; i++)
+	{
+		if (up)
+			freq = freq >= raster->top ? raster->bottom : freq + raster->spacing;
+		else
+			freq = freq <= raster->bottom ? raster->top : freq - raster->spacing;
+
+		int8_t rssi;
+		if (station_at(freq, &rssi) && rssi >= SIM_SEEK_RSSI)
+			return sim_tune(tuner, freq);
+	}
+	return TUNER_FAILED;
+}
+
+uint8_t sim_scan(Tuner *tuner, FM_Station_List *list)
+{
+	for (uint8_t i = 0; i < NUM_SIM_STATIONS && list->size < FM_MAX_STATIONS; i++)
+	{
+		const Sim_Station *sim = &sim_stations[i];
+		if (sim->rssi < SIM_SEEK_RSSI)
+			continue;
+		FM_Station *station = &list->stations[list->size++];
+		station->freq = sim->freq;
+		station->pi = sim->pi;
+		station->rssi = sim->rssi;
+		station->snr = sim->snr;
+		station->multipath = 0;
+	}
+	return TUNER_OK;
+}
+
+uint8_t sim_get_quality(Tuner *tuner, Tuner_Quality *quality)
+{
+	int8_t rssi;
+	const Sim_Station *station = station_at(tuned_freq, &rssi);
+	quality->valid = rssi >= SIM_SEEK_RSSI;
+	quality->rssi = rssi;
+	quality->snr = station && station->freq == tuned_freq ? station->snr : 0;
+	quality->quality = quality->snr * 100 / 40;
+	quality->stereo = quality->snr >= 20;
+	return TUNER_OK;
+}
+
+uint8_t sim_get_metadata(Tuner *tuner, Tuner_Metadata *metadata)
+{
+	int8_t rssi;
+	const Sim_Station *station = station_at(tuned_freq, &rssi);
+	if (!station || station->freq != tuned_freq || !station->pi)
+		return TUNER_FAILED;
+
+	metadata->id = station->pi;
+	strncpy(metadata->name, station->ps, sizeof(metadata->name) - 1);
+	return TUNER_OK;
+}
+
+void sim_task(Tuner *tuner)
+{
+	if (!pending_tasks || --pending_tasks)
+		return;
+
+	tuned_freq = pending_freq;
+	Tuner_Result result;
+	result.status = TUNER_OK;
+	result.freq = tuned_freq;
+	sim_get_quality(tuner, &result.quality);
+	tuner_complete(tuner, &result);
+}
+
+// Nearest station within a channel, rssi is the noise floor when there is none
+const Sim_Station *station_at(Freq_kHz freq, int8_t *rssi)
+{
+	*rssi = SIM_NOISE_RSSI;
+	for (uint8_t i = 0; i < NUM_SIM_STATIONS; i++)
+	{
+		const Sim_Station *station = &sim_stations[i];
+		if (station->freq == freq)
+		{
+			*rssi = station->rssi;
+			return station;
+		}
+		if (station->freq + FM_EUROPE_SPACING == freq || station->freq == freq + FM_EUROPE_SPACING)
+		{
+			int8_t adjacent = station->rssi - SIM_ADJACENT_LOSS;
+			if (adjacent > *rssi)
+				*rssi = adjacent;
+		}
+	}
+	return NULL;
+}